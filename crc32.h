@@ -0,0 +1,13 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Standard (IEEE 802.3, reflected) CRC32.  Start with crc = 0, and pass
+ * the result back in to continue over further data.
+ */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /* __CRC32_H__ */
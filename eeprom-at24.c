@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "eeprom-backend.h"
+
+/*
+ * Access through the kernel at24 driver's sysfs "eeprom" attribute.
+ * The driver does its own paging and write-cycle timing, so writes are
+ * complete by the time pwrite() returns, and a whole run of pages can
+ * go in one pwrite().  sysfs moves at most a memory page per call, so
+ * larger transfers are looped over.
+ */
+struct eeprom_at24 {
+	struct eeprom_backend		be;
+
+	/* File handle to the sysfs eeprom attribute */
+	int				fd;
+};
+
+static int eeprom_read_at24(struct eeprom_backend *be, uint32_t offset,
+			    void *data, uint32_t count) {
+	struct eeprom_at24 *at24 = (struct eeprom_at24 *)be;
+	char *buf = data;
+	int attempt = 0;
+
+	while (count > 0) {
+		uint64_t start = eeprom_txn_start();
+		ssize_t ret = pread(at24->fd, buf, count, offset);
+
+		be->transactions++;
+		eeprom_txn_record(be, eeprom_txn_read, start,
+				  ret > 0 ? ret : 0, ret <= 0);
+		if (ret < 0 && eeprom_backend_retry(be, eeprom_txn_read,
+						    attempt++, errno))
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				return eeprom_error(be->error, eeprom_err_range,
+						    "Read past end of EEPROM");
+			return eeprom_syserror(be->error, eeprom_err_bus,
+					       "Unable to read eeprom");
+		}
+		attempt = 0;
+		buf += ret;
+		offset += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+static int eeprom_write_at24(struct eeprom_backend *be, uint32_t offset,
+			     const void *data, uint32_t count) {
+	struct eeprom_at24 *at24 = (struct eeprom_at24 *)be;
+	const char *buf = data;
+	int attempt = 0;
+
+	while (count > 0) {
+		uint64_t start = eeprom_txn_start();
+		ssize_t ret = pwrite(at24->fd, buf, count, offset);
+
+		be->transactions++;
+		eeprom_txn_record(be, eeprom_txn_write, start,
+				  ret > 0 ? ret : 0, ret <= 0);
+		if (ret < 0 && eeprom_backend_retry(be, eeprom_txn_write,
+						    attempt++, errno))
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				return eeprom_error(be->error, eeprom_err_range,
+						    "Write past end of EEPROM");
+			return eeprom_syserror(be->error, eeprom_err_bus,
+					       "Unable to write eeprom");
+		}
+		attempt = 0;
+		buf += ret;
+		offset += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+static void eeprom_close_at24(struct eeprom_backend *be) {
+	struct eeprom_at24 *at24 = (struct eeprom_at24 *)be;
+
+	close(at24->fd);
+	free(at24);
+}
+
+static const struct eeprom_backend_ops eeprom_at24_ops = {
+	.read	= eeprom_read_at24,
+	.write	= eeprom_write_at24,
+	.close	= eeprom_close_at24,
+};
+
+struct eeprom_backend *eeprom_at24_open(const char *path,
+					struct eeprom_error *err) {
+	struct eeprom_at24 *at24;
+
+	at24 = malloc(sizeof(*at24));
+	if (!at24) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto malloc_err;
+	}
+
+	memset(at24, 0, sizeof(*at24));
+
+	at24->fd = open(path, O_RDWR);
+	if (at24->fd == -1) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to open eeprom file %s", path);
+		goto open_err;
+	}
+
+	at24->be.name = "at24";
+	at24->be.error = err;
+	at24->be.ops = &eeprom_at24_ops;
+	at24->be.spans_pages = 1;
+
+	return &at24->be;
+
+open_err:
+	free(at24);
+malloc_err:
+	return NULL;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "eeprom-backend.h"
+
+#define SIM_PREFIX "sim:"
+
+/* Where the at24 driver puts the chip at addr on /dev/i2c-bus, if bound */
+#define AT24_SYSFS_PATH "/sys/bus/i2c/devices/%d-%04x/eeprom"
+
+/*
+ * If the at24 driver has the chip, go through it rather than fighting
+ * it for the bus.  Returns nonzero with the sysfs path in sysfs if so.
+ */
+static int at24_bound(const char *path, int addr, char *sysfs, size_t len) {
+	struct stat st;
+	int bus;
+	int end = 0;
+
+	if (sscanf(path, "/dev/i2c-%d%n", &bus, &end) != 1 || path[end])
+		return 0;
+
+	snprintf(sysfs, len, AT24_SYSFS_PATH, bus, addr);
+	return stat(sysfs, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+uint64_t eeprom_txn_start(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void eeprom_txn_record(struct eeprom_backend *be, enum eeprom_txn_kind kind,
+		       uint64_t start_ns, uint32_t bytes, int failed) {
+	struct eeprom_txn_stats *txn = &be->txn[kind];
+	uint64_t ns = eeprom_txn_start() - start_ns;
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us && bucket < EEPROM_TXN_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	txn->count++;
+	if (failed)
+		txn->errors++;
+	else
+		txn->bytes += bytes;
+	txn->total_ns += ns;
+	if (ns > txn->max_ns)
+		txn->max_ns = ns;
+	txn->histogram[bucket]++;
+}
+
+int eeprom_backend_retry(struct eeprom_backend *be, enum eeprom_txn_kind kind,
+			 int attempt, int err) {
+	struct timespec delay;
+	uint64_t us;
+
+	if (err != EAGAIN && err != EREMOTEIO && err != ETIMEDOUT)
+		return 0;
+	if (attempt >= be->retries)
+		return 0;
+
+	us = (uint64_t)RETRY_BASE_US << (attempt < 20 ? attempt : 20);
+	if (us > be->retry_max_ms * 1000ULL)
+		us = be->retry_max_ms * 1000ULL;
+	delay.tv_sec = us / 1000000;
+	delay.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&delay, NULL);
+
+	be->txn[kind].retries++;
+	return 1;
+}
+
+void eeprom_txn_add(struct eeprom_txn_stats *to,
+		    const struct eeprom_txn_stats *from) {
+	int i;
+
+	to->count += from->count;
+	to->errors += from->errors;
+	to->retries += from->retries;
+	to->bytes += from->bytes;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+	for (i = 0; i < EEPROM_TXN_BUCKETS; i++)
+		to->histogram[i] += from->histogram[i];
+}
+
+struct eeprom_backend *eeprom_backend_open(const char *path, int addr,
+					   struct eeprom_error *err) {
+	struct eeprom_backend *be;
+	char sysfs[64];
+	struct stat st;
+
+	if (!strncmp(path, SIM_PREFIX, strlen(SIM_PREFIX)))
+		be = eeprom_sim_open(path + strlen(SIM_PREFIX), err);
+	else if (stat(path, &st) == -1) {
+		eeprom_syserror(err, eeprom_err_not_found,
+				"Unable to find EEPROM device %s", path);
+		return NULL;
+	}
+	/* sysfs attributes are regular files, bus nodes are char devices */
+	else if (S_ISREG(st.st_mode))
+		be = eeprom_at24_open(path, err);
+	else if (at24_bound(path, addr, sysfs, sizeof(sysfs)))
+		be = eeprom_at24_open(sysfs, err);
+	else
+		be = eeprom_i2c_open(path, addr, err);
+
+	if (be) {
+		be->retries = RETRY_DEFAULT_COUNT;
+		be->retry_max_ms = RETRY_DEFAULT_MAX_MS;
+	}
+	return be;
+}
@@ -0,0 +1,159 @@
+#ifndef __EEPROM_BACKEND_H__
+#define __EEPROM_BACKEND_H__
+
+#include <stdint.h>
+
+#include "eeprom-error.h"
+
+#pragma GCC visibility push(default)
+
+/*
+ * A backend moves raw bytes to and from an EEPROM.  It knows nothing
+ * about the Novena data layout; paging, caching and versioning are all
+ * handled by the caller.
+ */
+struct eeprom_backend;
+
+/* Kinds of bus transaction, kept apart in the statistics */
+enum eeprom_txn_kind {
+	eeprom_txn_read,
+	eeprom_txn_write,
+	eeprom_txn_poll,		/* Write-cycle polls; busy ones fail */
+	eeprom_txn_kinds,
+};
+
+/*
+ * Latency histogram buckets.  Bucket 0 counts transactions under 1 us,
+ * bucket n those taking [2^(n-1), 2^n) us, and the last one everything
+ * slower.
+ */
+#define EEPROM_TXN_BUCKETS 20
+
+/*
+ * Transient failures (arbitration lost to another master, a NAK, a
+ * timeout) are retried after a backoff that starts at RETRY_BASE_US and
+ * doubles each time, up to retry_max_ms.
+ */
+#define RETRY_BASE_US 500
+#define RETRY_DEFAULT_COUNT 5
+#define RETRY_DEFAULT_MAX_MS 20
+
+struct eeprom_txn_stats {
+	unsigned long			count;
+	unsigned long			errors;
+
+	/* Transactions reissued after a failure, e.g. with smaller reads */
+	unsigned long			retries;
+
+	/* Bytes moved by the transactions that succeeded */
+	uint64_t			bytes;
+
+	uint64_t			total_ns;
+	uint64_t			max_ns;
+	unsigned long			histogram[EEPROM_TXN_BUCKETS];
+};
+
+struct eeprom_backend_ops {
+	/* Read count bytes starting at offset */
+	int (*read)(struct eeprom_backend *be, uint32_t offset,
+		    void *data, uint32_t count);
+
+	/*
+	 * Write count bytes at offset.  Callers never cross a page, nor
+	 * pass more than max_write bytes.
+	 */
+	int (*write)(struct eeprom_backend *be, uint32_t offset,
+		     const void *data, uint32_t count);
+
+	/*
+	 * Returns 0 once the device has finished its internal write
+	 * cycle, or nonzero if it is still busy.  NULL if writes are
+	 * already complete by the time write() returns.
+	 */
+	int (*ready)(struct eeprom_backend *be);
+
+	/* Release the backend and everything it holds */
+	void (*close)(struct eeprom_backend *be);
+};
+
+struct eeprom_backend {
+	/* Short name of the backend type, e.g. "i2c" */
+	const char			*name;
+
+	/* Where failures are recorded, given when it was opened */
+	struct eeprom_error		*error;
+
+	const struct eeprom_backend_ops	*ops;
+
+	/* Most bytes one write() can take, or 0 for a whole page */
+	uint32_t			max_write;
+
+	/* Nonzero if write() may cross pages, as something below the
+	 * backend splits writes into pages itself */
+	int				spans_pages;
+
+	/* Number of bus transactions (ioctls or syscalls) issued */
+	unsigned long			transactions;
+
+	/* Timing of each transaction, by kind */
+	struct eeprom_txn_stats		txn[eeprom_txn_kinds];
+
+	/* Times to retry a transaction that failed transiently, and the
+	 * longest to back off before any one retry */
+	int				retries;
+	int				retry_max_ms;
+};
+
+/*
+ * Open a backend by path.  "sim:file[,options]" opens a simulated
+ * EEPROM, a regular file is taken to be an at24 sysfs "eeprom"
+ * attribute, and anything else an I2C bus device node.  An I2C bus
+ * whose chip at addr is bound to the at24 driver is reached through
+ * the driver's sysfs attribute instead.  Failures, both here and in
+ * later calls on the backend, are recorded in err.
+ */
+struct eeprom_backend *eeprom_backend_open(const char *path, int addr,
+					   struct eeprom_error *err);
+
+/*
+ * Account for one transaction of the given kind that began at start_ns
+ * (from eeprom_txn_start()).  bytes only count if it succeeded.
+ */
+uint64_t eeprom_txn_start(void);
+void eeprom_txn_record(struct eeprom_backend *be, enum eeprom_txn_kind kind,
+		       uint64_t start_ns, uint32_t bytes, int failed);
+
+/*
+ * Called when a transaction fails with errno err on its attempt'th try
+ * (counting from 0).  If the error is transient and there are retries
+ * left, backs off and returns nonzero, and the caller should reissue
+ * the same transaction.
+ */
+int eeprom_backend_retry(struct eeprom_backend *be, enum eeprom_txn_kind kind,
+			 int attempt, int err);
+
+/* Add the statistics in from to those in to */
+void eeprom_txn_add(struct eeprom_txn_stats *to,
+		    const struct eeprom_txn_stats *from);
+
+struct eeprom_backend *eeprom_i2c_open(const char *path, int addr,
+				       struct eeprom_error *err);
+
+/*
+ * Read count bytes at offset from whatever answers at addr on an open
+ * bus, without reporting errors.  Chips claimed by a kernel driver are
+ * skipped, and nothing is written to a chip until it has answered a
+ * plain read.  Adapters that can't do plain I2C are only read, over
+ * SMBus a byte at a time, if smbus is set.  Returns nonzero if nothing
+ * acknowledged.  Used to scan for chips.
+ */
+int eeprom_i2c_peek(int fd, int addr, int smbus, uint32_t offset,
+		    void *data, uint32_t count);
+struct eeprom_backend *eeprom_at24_open(const char *path,
+					struct eeprom_error *err);
+struct eeprom_backend *eeprom_sim_open(const char *spec,
+				       struct eeprom_error *err);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_BACKEND_H__ */
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eeprom-batch.h"
+
+static uint64_t mac_to_u64(const uint8_t mac[6]) {
+	uint64_t val = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		val = (val << 8) | mac[i];
+	return val;
+}
+
+static void u64_to_mac(uint64_t val, uint8_t mac[6]) {
+	int i;
+
+	for (i = 5; i >= 0; i--) {
+		mac[i] = val;
+		val >>= 8;
+	}
+}
+
+/* Trim leading and trailing whitespace in place */
+static char *strip(char *str) {
+	char *end;
+
+	while (isspace(*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		*--end = '\0';
+	return str;
+}
+
+/* Load a template image, as written by -e */
+static int batch_load_template(struct eeprom_batch *batch,
+			       const char *filename,
+			       struct eeprom_error *err) {
+	FILE *f;
+	int ret;
+
+	f = fopen(filename, "r");
+	if (NULL == f)
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to open template %s", filename);
+
+	/* Templates exported before v3 hold just the v2 header */
+	memset(&batch->template, 0, sizeof(batch->template));
+	ret = fread(&batch->template, 1, sizeof(batch->template), f);
+	fclose(f);
+	if (ret < (int)sizeof(batch->template.v2))
+		return eeprom_error(err, eeprom_err_format,
+				    "Template %s is too short", filename);
+
+	if (memcmp(batch->template.v2.signature, NOVENA_SIGNATURE,
+			sizeof(batch->template.v2.signature))
+	 || (batch->template.v2.version != 2
+	  && novena_eeprom_check(&batch->template,
+				 sizeof(batch->template))))
+		return eeprom_error(err, eeprom_err_format,
+				    "Template %s is not a valid v2 or v3 "
+				    "EEPROM image", filename);
+
+	batch->have_template = 1;
+	return 0;
+}
+
+/* Load explicit "serial,mac,device" rows */
+static int batch_load_rows(struct eeprom_batch *batch, const char *filename,
+			   struct eeprom_error *err) {
+	char line[512];
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (NULL == f)
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to open rows file %s",
+				       filename);
+
+	while (fgets(line, sizeof(line), f)) {
+		struct eeprom_batch_row *row;
+		char *serial, *mac, *device;
+		char *str = strip(line);
+
+		lineno++;
+		if (!*str || *str == '#')
+			continue;
+
+		serial = str;
+		mac = strchr(serial, ',');
+		device = mac ? strchr(mac + 1, ',') : NULL;
+		if (!device) {
+			eeprom_error(err, eeprom_err_invalid,
+				     "%s:%d: expected serial,mac,device",
+				     filename, lineno);
+			goto err;
+		}
+		*mac++ = '\0';
+		*device++ = '\0';
+
+		row = realloc(batch->rows,
+			      (batch->nrows + 1) * sizeof(*batch->rows));
+		if (!row) {
+			eeprom_error(err, eeprom_err_nomem,
+				     "Unable to alloc data");
+			goto err;
+		}
+		batch->rows = row;
+		row = &batch->rows[batch->nrows];
+
+		row->serial = strtoul(strip(serial), NULL, 0);
+		if (eeprom_parse_mac(strip(mac), row->mac, NULL)) {
+			eeprom_error(err, eeprom_err_invalid,
+				     "%s:%d: unable to parse MAC address",
+				     filename, lineno);
+			goto err;
+		}
+		row->device = strdup(strip(device));
+		if (!row->device) {
+			eeprom_error(err, eeprom_err_nomem,
+				     "Unable to alloc data");
+			goto err;
+		}
+		batch->nrows++;
+	}
+
+	fclose(f);
+	return 0;
+
+err:
+	fclose(f);
+	return 1;
+}
+
+/*
+ * Carry on from where earlier runs left off, so rerunning a manifest
+ * never hands out the same serial or MAC twice.
+ */
+static int batch_resume_from_log(struct eeprom_batch *batch) {
+	char line[512];
+	FILE *f;
+
+	f = fopen(batch->log_path, "r");
+	if (NULL == f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *field;
+		uint8_t mac[6];
+
+		field = strstr(line, " serial=");
+		if (batch->have_serial && field && isdigit(field[8])) {
+			uint64_t serial = strtoul(field + 8, NULL, 0);
+			if (serial >= batch->next_serial)
+				batch->next_serial = serial + 1;
+		}
+
+		field = strstr(line, " mac=");
+		if (batch->have_mac && field && isxdigit(field[5])) {
+			char *end = strchr(field + 5, ' ');
+
+			if (end)
+				*end = '\0';
+			if (!eeprom_parse_mac(strip(field + 5), mac, NULL)
+			 && mac_to_u64(mac) >= batch->next_mac)
+				batch->next_mac = mac_to_u64(mac) + 1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/*
+ * A manifest is a list of "key = value" lines:
+ *
+ *   template = base.rom        image to start each board from
+ *   serial = 1000              first serial to hand out
+ *   serial_end = 1999          last serial to hand out
+ *   mac = 00:11:22:33:44:00    first MAC to hand out
+ *   mac_end = 00:11:22:33:47:ff  last MAC to hand out
+ *   rows = boards.csv          explicit serial,mac,device assignments
+ *   log = results.log          file to append outcomes to
+ */
+int eeprom_batch_load(struct eeprom_batch *batch, const char *manifest,
+		      struct eeprom_error *err) {
+	char line[512];
+	int lineno = 0;
+	int have_serial_end = 0;
+	int have_mac_end = 0;
+	FILE *f;
+
+	memset(batch, 0, sizeof(*batch));
+	pthread_mutex_init(&batch->lock, NULL);
+
+	f = fopen(manifest, "r");
+	if (NULL == f)
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to open manifest %s", manifest);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *key, *value;
+		char *str = strip(line);
+		uint8_t mac[6];
+
+		lineno++;
+		if (!*str || *str == '#')
+			continue;
+
+		value = strchr(str, '=');
+		if (!value) {
+			eeprom_error(err, eeprom_err_invalid,
+				     "%s:%d: expected key = value",
+				     manifest, lineno);
+			goto err;
+		}
+		*value++ = '\0';
+		key = strip(str);
+		value = strip(value);
+
+		if (!strcmp(key, "template")) {
+			if (batch_load_template(batch, value, err))
+				goto err;
+		}
+		else if (!strcmp(key, "serial")
+		      || !strcmp(key, "serial_end")) {
+			char *end;
+			unsigned long serial;
+
+			errno = 0;
+			serial = strtoul(value, &end, 0);
+			if (!*value || *end || errno || serial > UINT32_MAX) {
+				eeprom_error(err, eeprom_err_invalid,
+					     "%s:%d: unable to parse serial "
+					     "number", manifest, lineno);
+				goto err;
+			}
+			if (!strcmp(key, "serial")) {
+				batch->next_serial = serial;
+				batch->have_serial = 1;
+			}
+			else {
+				batch->last_serial = serial;
+				have_serial_end = 1;
+			}
+		}
+		else if (!strcmp(key, "mac") || !strcmp(key, "mac_end")) {
+			if (eeprom_parse_mac(value, mac, NULL)) {
+				eeprom_error(err, eeprom_err_invalid,
+					     "%s:%d: unable to parse MAC "
+					     "address", manifest, lineno);
+				goto err;
+			}
+			if (!strcmp(key, "mac")) {
+				batch->next_mac = mac_to_u64(mac);
+				batch->have_mac = 1;
+			}
+			else {
+				batch->last_mac = mac_to_u64(mac);
+				have_mac_end = 1;
+			}
+		}
+		else if (!strcmp(key, "rows")) {
+			if (batch_load_rows(batch, value, err))
+				goto err;
+		}
+		else if (!strcmp(key, "log")) {
+			free(batch->log_path);
+			batch->log_path = strdup(value);
+			if (!batch->log_path) {
+				eeprom_error(err, eeprom_err_nomem,
+					     "Unable to alloc data");
+				goto err;
+			}
+		}
+		else {
+			eeprom_error(err, eeprom_err_invalid,
+				     "%s:%d: unrecognized key \"%s\"",
+				     manifest, lineno, key);
+			goto err;
+		}
+	}
+
+	fclose(f);
+
+	if (batch->nrows && (batch->have_serial || batch->have_mac)) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "%s: rows can't be combined with serial or mac "
+			     "ranges", manifest);
+		eeprom_batch_free(batch);
+		return 1;
+	}
+
+	/*
+	 * Without an end, serials run to the largest the header holds,
+	 * and MACs to the end of the first one's OUI.
+	 */
+	if (!have_serial_end)
+		batch->last_serial = UINT32_MAX;
+	if (!have_mac_end)
+		batch->last_mac = batch->next_mac | 0xffffff;
+
+	if ((have_serial_end && !batch->have_serial)
+	 || (have_mac_end && !batch->have_mac)) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "%s: serial_end and mac_end need serial and mac",
+			     manifest);
+		eeprom_batch_free(batch);
+		return 1;
+	}
+
+	if ((batch->have_serial && batch->last_serial < batch->next_serial)
+	 || (batch->have_mac && batch->last_mac < batch->next_mac)) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "%s: a range ends before it starts", manifest);
+		eeprom_batch_free(batch);
+		return 1;
+	}
+
+	if (batch->log_path)
+		batch_resume_from_log(batch);
+
+	return 0;
+
+err:
+	fclose(f);
+	eeprom_batch_free(batch);
+	return 1;
+}
+
+void eeprom_batch_free(struct eeprom_batch *batch) {
+	int i;
+
+	for (i = 0; i < batch->nrows; i++)
+		free(batch->rows[i].device);
+	free(batch->rows);
+	free(batch->log_path);
+	pthread_mutex_destroy(&batch->lock);
+	batch->rows = NULL;
+	batch->nrows = 0;
+	batch->log_path = NULL;
+}
+
+/*
+ * Append a line to the log and get it onto the disk before returning,
+ * so that a crash straight afterwards can't lose it.  Called with the
+ * lock held, so lines from different boards never interleave.
+ */
+static int batch_append(struct eeprom_batch *batch, const char *device,
+			int addr, const struct eeprom_dev *dev, int assigned,
+			const char *status, struct eeprom_error *err) {
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	FILE *f;
+
+	if (!batch->log_path)
+		return 0;
+
+	f = fopen(batch->log_path, "a");
+	if (NULL == f)
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to open batch log %s",
+				       batch->log_path);
+
+	gmtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	fprintf(f, "%s %s@0x%02x", stamp, device, addr);
+	if (assigned) {
+		const uint8_t *mac = dev->data.v2.mac;
+
+		fprintf(f, " serial=%u mac=%02x:%02x:%02x:%02x:%02x:%02x",
+			dev->data.v2.serial,
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	}
+	fprintf(f, " %s\n", status);
+
+	if (fflush(f) || fsync(fileno(f))) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to write batch log %s",
+				batch->log_path);
+		fclose(f);
+		return 1;
+	}
+
+	if (fclose(f))
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to write batch log %s",
+				       batch->log_path);
+	return 0;
+}
+
+int eeprom_batch_assign(struct eeprom_batch *batch, int row,
+			struct eeprom_dev *dev, const char *device, int addr,
+			struct eeprom_error *err) {
+	int ret;
+
+	pthread_mutex_lock(&batch->lock);
+	if (batch->nrows) {
+		dev->data.v2.serial = batch->rows[row].serial;
+		memcpy(dev->data.v2.mac, batch->rows[row].mac,
+			sizeof(dev->data.v2.mac));
+	}
+	else if ((batch->have_serial
+		  && batch->next_serial > batch->last_serial)
+	      || (batch->have_mac && batch->next_mac > batch->last_mac)) {
+		pthread_mutex_unlock(&batch->lock);
+		return eeprom_error(err, eeprom_err_no_space,
+				    "The batch's %s range is used up",
+				    batch->have_serial
+				    && batch->next_serial > batch->last_serial
+				    ? "serial" : "MAC");
+	}
+	else {
+		if (batch->have_serial)
+			dev->data.v2.serial = batch->next_serial++;
+		if (batch->have_mac)
+			u64_to_mac(batch->next_mac++, dev->data.v2.mac);
+	}
+	ret = batch_append(batch, device, addr, dev, 1, "assigned", err);
+	pthread_mutex_unlock(&batch->lock);
+
+	return ret;
+}
+
+int eeprom_batch_log(struct eeprom_batch *batch, const char *device,
+		     int addr, const struct eeprom_dev *dev, int assigned,
+		     const char *status, struct eeprom_error *err) {
+	int ret;
+
+	pthread_mutex_lock(&batch->lock);
+	ret = batch_append(batch, device, addr, dev, assigned, status, err);
+	pthread_mutex_unlock(&batch->lock);
+
+	return ret;
+}
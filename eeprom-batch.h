@@ -0,0 +1,78 @@
+#ifndef __EEPROM_BATCH_H__
+#define __EEPROM_BATCH_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "eeprom.h"
+
+#pragma GCC visibility push(default)
+
+/* An explicit assignment from a manifest's rows file */
+struct eeprom_batch_row {
+	char				*device;
+	uint32_t			serial;
+	uint8_t				mac[6];
+};
+
+/*
+ * A batch of boards to provision, as described by a manifest.  Boards
+ * either get the next serial and MAC from a range, or the values from
+ * an explicit row.  Everything is parsed once, when the manifest is
+ * loaded.
+ */
+struct eeprom_batch {
+	/* Image each board starts from, if have_template is set */
+	int				have_template;
+	union novena_eeprom_data	template;
+
+	/*
+	 * Next serial and MAC to hand out, in range mode, and the last of
+	 * each that may be.  Serials are kept wider than the header field
+	 * so that running off the end can't wrap back to 0.
+	 */
+	int				have_serial;
+	uint64_t			next_serial;
+	uint64_t			last_serial;
+	int				have_mac;
+	uint64_t			next_mac;
+	uint64_t			last_mac;
+
+	/* Explicit assignments, in rows mode */
+	struct eeprom_batch_row		*rows;
+	int				nrows;
+
+	/* File the outcome of each board is appended to, or NULL */
+	char				*log_path;
+
+	/* Protects the range counters and the log */
+	pthread_mutex_t			lock;
+};
+
+/* Failures are recorded in err, with the file and line at fault */
+int eeprom_batch_load(struct eeprom_batch *batch, const char *manifest,
+		      struct eeprom_error *err);
+void eeprom_batch_free(struct eeprom_batch *batch);
+
+/*
+ * Stamp the serial and MAC for the board on device at addr into
+ * dev->data.  In rows mode, row selects the explicit assignment; in
+ * range mode the next values are handed out, failing once a range runs
+ * out.  The assignment is logged
+ * and synced before returning, so values handed out are never handed
+ * out again even if the run is cut short.  If it can't be logged, this
+ * fails and the board must not be written.  Safe to call from several
+ * threads at once.
+ */
+int eeprom_batch_assign(struct eeprom_batch *batch, int row,
+			struct eeprom_dev *dev, const char *device, int addr,
+			struct eeprom_error *err);
+
+/* Log how a board got on, syncing the line to disk */
+int eeprom_batch_log(struct eeprom_batch *batch, const char *device,
+		     int addr, const struct eeprom_dev *dev, int assigned,
+		     const char *status, struct eeprom_error *err);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_BATCH_H__ */
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "eeprom.h"
+#include "crc32.h"
+
+#define CACHE_MAGIC "NVEECACH"
+
+struct eeprom_cache_file {
+	char				magic[8];
+	uint32_t			addr;
+
+	/* CRC32 over slots, to catch a damaged cache file */
+	uint32_t			crc;
+
+	union novena_eeprom_data	slots[EEPROM_SLOTS];
+} __attribute__((__packed__));
+
+/*
+ * Point dev at a cache file in dir, named after its bus and address.
+ * Slashes in the bus path are replaced, so "/dev/i2c-2" at 0x56 is
+ * cached as "dir/_dev_i2c-2@0x56".
+ */
+int eeprom_cache_enable(struct eeprom_dev *dev, const char *dir) {
+	size_t len = strlen(dir) + strlen(dev->path) + 16;
+	char *p;
+
+	free(dev->cache_path);
+	dev->cache_path = malloc(len);
+	if (!dev->cache_path)
+		return eeprom_error(&dev->error, eeprom_err_nomem,
+				    "Unable to alloc data");
+
+	snprintf(dev->cache_path, len, "%s/", dir);
+	p = dev->cache_path + strlen(dev->cache_path);
+	snprintf(p, len - (p - dev->cache_path), "%s@0x%02x",
+		 dev->path, dev->addr);
+	for (; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	mkdir(dir, 0755);
+	return 0;
+}
+
+/* Fetch the cached header slots, if there are some and they are intact */
+int eeprom_cache_load(struct eeprom_dev *dev, union novena_eeprom_data *slots) {
+	struct eeprom_cache_file cache;
+	FILE *f;
+	int ret;
+
+	if (!dev->cache_path)
+		return 1;
+
+	f = fopen(dev->cache_path, "r");
+	if (NULL == f)
+		return 1;
+
+	ret = fread(&cache, sizeof(cache), 1, f);
+	fclose(f);
+	if (ret != 1)
+		return 1;
+
+	if (memcmp(cache.magic, CACHE_MAGIC, sizeof(cache.magic))
+	 || cache.addr != (uint32_t)dev->addr
+	 || cache.crc != crc32(0, cache.slots, sizeof(cache.slots)))
+		return 1;
+
+	memcpy(slots, cache.slots, sizeof(cache.slots));
+	return 0;
+}
+
+/* Record dev->shadow, which matches the chip, as the cached image */
+int eeprom_cache_store(struct eeprom_dev *dev) {
+	struct eeprom_cache_file cache;
+	size_t len;
+	char *tmp;
+	FILE *f;
+
+	if (!dev->cache_path || !dev->shadow_valid)
+		return 0;
+
+	memset(&cache, 0, sizeof(cache));
+	memcpy(cache.magic, CACHE_MAGIC, sizeof(cache.magic));
+	cache.addr = dev->addr;
+	memcpy(cache.slots, dev->shadow, sizeof(cache.slots));
+	cache.crc = crc32(0, cache.slots, sizeof(cache.slots));
+
+	/* Write a new file and rename it, so readers never see half of one */
+	len = strlen(dev->cache_path) + 8;
+	tmp = malloc(len);
+	if (!tmp)
+		return eeprom_error(&dev->error, eeprom_err_nomem,
+				    "Unable to alloc data");
+	snprintf(tmp, len, "%s.new", dev->cache_path);
+
+	f = fopen(tmp, "w");
+	if (NULL == f) {
+		free(tmp);
+		return 1;
+	}
+
+	if (fwrite(&cache, sizeof(cache), 1, f) != 1) {
+		fclose(f);
+		goto err;
+	}
+	if (fclose(f))
+		goto err;
+	if (rename(tmp, dev->cache_path))
+		goto err;
+
+	free(tmp);
+	return 0;
+
+err:
+	unlink(tmp);
+	free(tmp);
+	return 1;
+}
+
+void eeprom_cache_invalidate(struct eeprom_dev *dev) {
+	if (dev->cache_path)
+		unlink(dev->cache_path);
+}
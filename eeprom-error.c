@@ -0,0 +1,86 @@
+/*
+ * Ask for the XSI strerror_r(), which returns an int, even if whoever
+ * builds the library defines _GNU_SOURCE and would get the GNU one,
+ * which returns a char *.
+ */
+#undef _GNU_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include "eeprom-error.h"
+
+static const char *errcode_names[] = {
+	[eeprom_err_none]		= "Success",
+	[eeprom_err_system]		= "System call failed",
+	[eeprom_err_nomem]		= "Out of memory",
+	[eeprom_err_bus]		= "Bus error",
+	[eeprom_err_timeout]		= "Timed out",
+	[eeprom_err_invalid]		= "Invalid argument",
+	[eeprom_err_range]		= "Out of range",
+	[eeprom_err_format]		= "Bad data",
+	[eeprom_err_not_found]		= "Not found",
+	[eeprom_err_no_space]		= "No space left",
+	[eeprom_err_verify]		= "Verify failed",
+	[eeprom_err_unsupported]	= "Not supported",
+	[eeprom_err_stopped]		= "Stopped",
+};
+
+static void error_set(struct eeprom_error *err, enum eeprom_errcode code,
+		      int sys_errno, const char *fmt, va_list ap) {
+	size_t len;
+
+	err->code = code;
+	err->sys_errno = sys_errno;
+	vsnprintf(err->message, sizeof(err->message), fmt, ap);
+
+	len = strlen(err->message);
+	if (sys_errno && len < sizeof(err->message)) {
+		char reason[128];
+
+		/* strerror() may share its buffer with other threads */
+		if (strerror_r(sys_errno, reason, sizeof(reason)))
+			snprintf(reason, sizeof(reason), "error %d",
+				 sys_errno);
+		snprintf(err->message + len, sizeof(err->message) - len,
+			 ": %s", reason);
+	}
+}
+
+int eeprom_error(struct eeprom_error *err, enum eeprom_errcode code,
+		 const char *fmt, ...) {
+	va_list ap;
+
+	if (!err)
+		return 1;
+
+	va_start(ap, fmt);
+	error_set(err, code, 0, fmt, ap);
+	va_end(ap);
+	return 1;
+}
+
+int eeprom_syserror(struct eeprom_error *err, enum eeprom_errcode code,
+		    const char *fmt, ...) {
+	int sys_errno = errno;
+	va_list ap;
+
+	if (!err)
+		return 1;
+
+	va_start(ap, fmt);
+	error_set(err, code, sys_errno, fmt, ap);
+	va_end(ap);
+
+	errno = sys_errno;
+	return 1;
+}
+
+const char *eeprom_strerror(enum eeprom_errcode code) {
+	if ((unsigned)code >= sizeof(errcode_names) / sizeof(*errcode_names))
+		return "Unknown error";
+	return errcode_names[code];
+}
@@ -0,0 +1,58 @@
+#ifndef __EEPROM_ERROR_H__
+#define __EEPROM_ERROR_H__
+
+#pragma GCC visibility push(default)
+
+/*
+ * The library never prints.  A call that fails returns nonzero and
+ * leaves the reason in the struct eeprom_error it was given (for most
+ * calls, the one in the eeprom_dev), for the caller to report or act
+ * on as it sees fit.
+ */
+
+enum eeprom_errcode {
+	eeprom_err_none = 0,
+	eeprom_err_system,		/* A system call failed, see sys_errno */
+	eeprom_err_nomem,
+	eeprom_err_bus,			/* The bus or the chip didn't respond */
+	eeprom_err_timeout,		/* A write cycle didn't finish in time */
+	eeprom_err_invalid,		/* Bad argument, option or input text */
+	eeprom_err_range,		/* Runs past the end of the chip or area */
+	eeprom_err_format,		/* Damaged or unrecognized data */
+	eeprom_err_not_found,		/* No such header, area or record */
+	eeprom_err_no_space,		/* Area too full for what was asked */
+	eeprom_err_verify,		/* Read back different from what was written */
+	eeprom_err_unsupported,		/* Not possible with this device */
+	eeprom_err_stopped,		/* A caller's callback asked to stop */
+};
+
+struct eeprom_error {
+	enum eeprom_errcode		code;
+
+	/* errno of the failed system call, for eeprom_err_system and
+	 * eeprom_err_bus, otherwise 0 */
+	int				sys_errno;
+
+	/* What went wrong, as a sentence without a newline */
+	char				message[256];
+};
+
+/*
+ * Record a failure in err, which may be NULL, with a printf-style
+ * message.  eeprom_syserror() adds strerror(errno) to the message, as
+ * perror() would, and keeps errno.  Both return 1, so that a function
+ * can fail with "return eeprom_error(...);".
+ */
+int eeprom_error(struct eeprom_error *err, enum eeprom_errcode code,
+		 const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int eeprom_syserror(struct eeprom_error *err, enum eeprom_errcode code,
+		    const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Short description of an error code */
+const char *eeprom_strerror(enum eeprom_errcode code);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_ERROR_H__ */
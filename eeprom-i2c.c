@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "eeprom-backend.h"
+
+/*
+ * Largest single read message.  The i2c-dev driver refuses messages
+ * longer than 8 KiB, and some adapters accept much less, in which case
+ * the read size is scaled back towards the minimum.
+ */
+#define MAX_READ_CHUNK 8192
+#define MIN_READ_CHUNK 32
+
+/*
+ * Adapters without plain I2C can still reach a 16-bit addressed EEPROM
+ * over SMBus.  The command byte carries the high address byte, and the
+ * low one goes first in the data.  An I2C block write then has room for
+ * 31 bytes of data; failing that, a word write carries a single byte.
+ */
+#define SMBUS_BLOCK_WRITE (I2C_SMBUS_BLOCK_MAX - 1)
+
+#define SMBUS_READ_FUNCS (I2C_FUNC_SMBUS_WRITE_BYTE_DATA \
+			| I2C_FUNC_SMBUS_READ_BYTE)
+#define SMBUS_BLOCK_FUNCS (SMBUS_READ_FUNCS | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)
+#define SMBUS_BYTE_FUNCS (SMBUS_READ_FUNCS | I2C_FUNC_SMBUS_WRITE_WORD_DATA)
+
+struct eeprom_i2c {
+	struct eeprom_backend		be;
+
+	/* File handle to I2C bus */
+	int				fd;
+
+	/* I2C address of the EEPROM */
+	int				addr;
+
+	/* Largest read message the adapter has accepted so far */
+	uint32_t			read_chunk;
+};
+
+/*
+ * Read count bytes starting at addr.  Large reads are split into
+ * chunks of at most read_chunk bytes, each preceded by its own
+ * address-set message, and as many chunks as the kernel allows are
+ * packed into a single I2C_RDWR ioctl.  If the adapter rejects the
+ * transfer size, the chunk size is halved and the transfer retried,
+ * and the smaller size is remembered for later reads.  Transient
+ * failures retry just the ioctl that failed, not the whole read.
+ */
+static int eeprom_read_i2c(struct eeprom_backend *be, uint32_t addr,
+			   void *data, uint32_t count) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	struct i2c_rdwr_ioctl_data session;
+	struct i2c_msg messages[I2C_RDWR_IOCTL_MAX_MSGS];
+	uint8_t set_addr_buf[I2C_RDWR_IOCTL_MAX_MSGS / 2][2];
+	uint8_t *buf = data;
+	uint64_t start;
+	int attempt = 0;
+	int ret;
+
+	memset(data, 0, count);
+
+	while (count > 0) {
+		uint32_t offset = 0;
+		int nchunks = 0;
+
+		while (offset < count
+		    && nchunks < I2C_RDWR_IOCTL_MAX_MSGS / 2) {
+			uint32_t len = count - offset;
+			struct i2c_msg *msg = &messages[nchunks * 2];
+
+			if (len > i2c->read_chunk)
+				len = i2c->read_chunk;
+
+			set_addr_buf[nchunks][0] = (addr + offset) >> 8;
+			set_addr_buf[nchunks][1] = (addr + offset);
+
+			msg[0].addr = i2c->addr;
+			msg[0].flags = 0;
+			msg[0].len = sizeof(set_addr_buf[nchunks]);
+			msg[0].buf = set_addr_buf[nchunks];
+
+			msg[1].addr = i2c->addr;
+			msg[1].flags = I2C_M_RD;
+			msg[1].len = len;
+			msg[1].buf = buf + offset;
+
+			offset += len;
+			nchunks++;
+		}
+
+		session.msgs = messages;
+		session.nmsgs = nchunks * 2;
+
+		start = eeprom_txn_start();
+		be->transactions++;
+		ret = ioctl(i2c->fd, I2C_RDWR, &session);
+		eeprom_txn_record(be, eeprom_txn_read, start, offset, ret < 0);
+		if (ret < 0) {
+			if ((errno == EINVAL || errno == EOPNOTSUPP)
+			 && i2c->read_chunk > MIN_READ_CHUNK) {
+				i2c->read_chunk /= 2;
+				be->txn[eeprom_txn_read].retries++;
+				continue;
+			}
+			if (eeprom_backend_retry(be, eeprom_txn_read, attempt++,
+						 errno))
+				continue;
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with i2c device");
+		}
+
+		attempt = 0;
+		addr += offset;
+		buf += offset;
+		count -= offset;
+	}
+
+	return 0;
+}
+
+static int eeprom_write_i2c(struct eeprom_backend *be, uint32_t addr,
+			    const void *data, uint32_t count) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	struct i2c_rdwr_ioctl_data session;
+	struct i2c_msg messages[1];
+	uint8_t data_buf[2+count];
+	uint64_t start;
+	int attempt;
+	int ret;
+
+	data_buf[0] = addr>>8;
+	data_buf[1] = addr;
+	memcpy(&data_buf[2], data, count);
+
+	messages[0].addr = i2c->addr;
+	messages[0].flags = 0;
+	messages[0].len = sizeof(data_buf);
+	messages[0].buf = data_buf;
+
+	session.msgs = messages;
+	session.nmsgs = 1;
+
+	for (attempt = 0; ; attempt++) {
+		start = eeprom_txn_start();
+		be->transactions++;
+		ret = ioctl(i2c->fd, I2C_RDWR, &session);
+		eeprom_txn_record(be, eeprom_txn_write, start, count, ret < 0);
+		if (ret >= 0)
+			return 0;
+
+		if (!eeprom_backend_retry(be, eeprom_txn_write, attempt,
+					  errno)) {
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with i2c device");
+		}
+	}
+}
+
+/*
+ * While the EEPROM is busy with its internal write cycle it will NAK
+ * its own address, so an address-only write succeeds exactly when the
+ * previous write has completed.
+ */
+static int eeprom_ready_i2c(struct eeprom_backend *be) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	struct i2c_rdwr_ioctl_data session;
+	struct i2c_msg messages[1];
+	uint8_t set_addr_buf[2];
+	uint64_t start;
+	int ret;
+
+	memset(set_addr_buf, 0, sizeof(set_addr_buf));
+
+	messages[0].addr = i2c->addr;
+	messages[0].flags = 0;
+	messages[0].len = sizeof(set_addr_buf);
+	messages[0].buf = set_addr_buf;
+
+	session.msgs = messages;
+	session.nmsgs = 1;
+
+	start = eeprom_txn_start();
+	be->transactions++;
+	ret = ioctl(i2c->fd, I2C_RDWR, &session) < 0;
+	eeprom_txn_record(be, eeprom_txn_poll, start, 0, ret);
+	return ret;
+}
+
+static int smbus_xfer(int fd, char rw, uint8_t command, int size,
+		      union i2c_smbus_data *data) {
+	struct i2c_smbus_ioctl_data args;
+
+	args.read_write = rw;
+	args.command = command;
+	args.size = size;
+	args.data = data;
+
+	return ioctl(fd, I2C_SMBUS, &args) < 0;
+}
+
+static int smbus_access(struct eeprom_i2c *i2c, char rw, uint8_t command,
+			int size, union i2c_smbus_data *data) {
+	i2c->be.transactions++;
+	return smbus_xfer(i2c->fd, rw, command, size, data);
+}
+
+/*
+ * The same transfers as eeprom_read_smbus().  Setting the address
+ * pointer is a byte-data write, which an EEPROM with 8-bit addresses
+ * takes as data, so this is only done on buses the user named.
+ */
+static int peek_smbus(int fd, uint32_t offset, uint8_t *data,
+		      uint32_t count) {
+	union i2c_smbus_data smbus;
+	uint32_t i;
+
+	/* Anything there at all?  A receive-byte writes nothing */
+	if (smbus_xfer(fd, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &smbus))
+		return 1;
+
+	smbus.byte = offset;
+	if (smbus_xfer(fd, I2C_SMBUS_WRITE, offset >> 8, I2C_SMBUS_BYTE_DATA,
+		       &smbus))
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		if (smbus_xfer(fd, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &smbus))
+			return 1;
+		data[i] = smbus.byte;
+	}
+
+	return 0;
+}
+
+int eeprom_i2c_peek(int fd, int addr, int smbus, uint32_t offset,
+		    void *data, uint32_t count) {
+	struct i2c_rdwr_ioctl_data session;
+	struct i2c_msg messages[2];
+	uint8_t set_addr_buf[2];
+	unsigned long funcs;
+	uint8_t byte;
+
+	if (ioctl(fd, I2C_FUNCS, &funcs) < 0)
+		funcs = I2C_FUNC_I2C;
+
+	/*
+	 * Leave alone chips that a kernel driver has claimed, such as
+	 * DIMM SPD or display DDC EEPROMs.
+	 */
+	if (ioctl(fd, I2C_SLAVE, addr) < 0)
+		return 1;
+
+	if (!(funcs & I2C_FUNC_I2C)) {
+		if (!smbus || (funcs & SMBUS_READ_FUNCS) != SMBUS_READ_FUNCS)
+			return 1;
+		return peek_smbus(fd, offset, data, count);
+	}
+
+	/* Anything there at all?  A lone read writes nothing */
+	messages[0].addr = addr;
+	messages[0].flags = I2C_M_RD;
+	messages[0].len = sizeof(byte);
+	messages[0].buf = &byte;
+
+	session.msgs = messages;
+	session.nmsgs = 1;
+
+	if (ioctl(fd, I2C_RDWR, &session) < 0)
+		return 1;
+
+	/*
+	 * Then a random read.  The address goes straight into a repeated
+	 * start with no stop, and a write cycle only begins at a stop, so
+	 * even a chip with 8-bit addresses stores nothing.
+	 */
+	set_addr_buf[0] = offset >> 8;
+	set_addr_buf[1] = offset;
+
+	messages[0].addr = addr;
+	messages[0].flags = 0;
+	messages[0].len = sizeof(set_addr_buf);
+	messages[0].buf = set_addr_buf;
+
+	messages[1].addr = addr;
+	messages[1].flags = I2C_M_RD;
+	messages[1].len = count;
+	messages[1].buf = data;
+
+	session.msgs = messages;
+	session.nmsgs = 2;
+
+	return ioctl(fd, I2C_RDWR, &session) < 0;
+}
+
+/*
+ * Set the chip's address pointer, then receive bytes one at a time as
+ * it counts through them.  A failure picks up again from the byte that
+ * failed.
+ */
+static int eeprom_read_smbus(struct eeprom_backend *be, uint32_t addr,
+			     void *data, uint32_t count) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	union i2c_smbus_data smbus;
+	uint8_t *buf = data;
+	uint32_t done = 0;
+	int attempt = 0;
+
+	while (done < count) {
+		uint64_t start = eeprom_txn_start();
+		uint32_t from = done;
+		int failed;
+
+		smbus.byte = addr + done;
+		failed = smbus_access(i2c, I2C_SMBUS_WRITE, (addr + done) >> 8,
+				      I2C_SMBUS_BYTE_DATA, &smbus);
+		while (!failed && done < count) {
+			failed = smbus_access(i2c, I2C_SMBUS_READ, 0,
+					      I2C_SMBUS_BYTE, &smbus);
+			if (!failed)
+				buf[done++] = smbus.byte;
+		}
+
+		eeprom_txn_record(be, eeprom_txn_read, start, done - from,
+				  failed);
+		if (!failed)
+			break;
+		if (done > from)
+			attempt = 0;
+		if (!eeprom_backend_retry(be, eeprom_txn_read, attempt++,
+					  errno)) {
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with i2c device");
+		}
+	}
+
+	return 0;
+}
+
+static int eeprom_write_smbus(struct eeprom_backend *be, uint32_t addr,
+			      const void *data, uint32_t count) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	union i2c_smbus_data smbus;
+	const uint8_t *buf = data;
+	int attempt;
+	int size;
+
+	if (be->max_write == 1) {
+		smbus.word = (addr & 0xff) | (buf[0] << 8);
+		size = I2C_SMBUS_WORD_DATA;
+	}
+	else {
+		smbus.block[0] = count + 1;
+		smbus.block[1] = addr;
+		memcpy(&smbus.block[2], buf, count);
+		size = I2C_SMBUS_I2C_BLOCK_DATA;
+	}
+
+	for (attempt = 0; ; attempt++) {
+		uint64_t start = eeprom_txn_start();
+		int failed;
+
+		failed = smbus_access(i2c, I2C_SMBUS_WRITE, addr >> 8, size,
+				      &smbus);
+		eeprom_txn_record(be, eeprom_txn_write, start, count, failed);
+		if (!failed)
+			return 0;
+
+		if (!eeprom_backend_retry(be, eeprom_txn_write, attempt,
+					  errno)) {
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with i2c device");
+		}
+	}
+}
+
+/* A busy chip NAKs a receive-byte as it does anything else */
+static int eeprom_ready_smbus(struct eeprom_backend *be) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+	union i2c_smbus_data smbus;
+	uint64_t start = eeprom_txn_start();
+	int failed;
+
+	failed = smbus_access(i2c, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &smbus);
+	eeprom_txn_record(be, eeprom_txn_poll, start, 0, failed);
+	return failed;
+}
+
+static void eeprom_close_i2c(struct eeprom_backend *be) {
+	struct eeprom_i2c *i2c = (struct eeprom_i2c *)be;
+
+	close(i2c->fd);
+	free(i2c);
+}
+
+static const struct eeprom_backend_ops eeprom_i2c_ops = {
+	.read	= eeprom_read_i2c,
+	.write	= eeprom_write_i2c,
+	.ready	= eeprom_ready_i2c,
+	.close	= eeprom_close_i2c,
+};
+
+static const struct eeprom_backend_ops eeprom_smbus_ops = {
+	.read	= eeprom_read_smbus,
+	.write	= eeprom_write_smbus,
+	.ready	= eeprom_ready_smbus,
+	.close	= eeprom_close_i2c,
+};
+
+/*
+ * Use plain I2C transfers if the adapter can do them, otherwise the
+ * fastest SMBus transfers it has.  Adapters that can't say are assumed
+ * to do plain I2C, as before.
+ */
+struct eeprom_backend *eeprom_i2c_open(const char *path, int addr,
+				       struct eeprom_error *err) {
+	struct eeprom_i2c *i2c;
+	unsigned long funcs;
+
+	i2c = malloc(sizeof(*i2c));
+	if (!i2c) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto malloc_err;
+	}
+
+	memset(i2c, 0, sizeof(*i2c));
+
+	i2c->fd = open(path, O_RDWR);
+	if (i2c->fd == -1) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to open i2c device %s", path);
+		goto open_err;
+	}
+
+	i2c->be.name = "i2c";
+	i2c->be.error = err;
+	i2c->be.ops = &eeprom_i2c_ops;
+	i2c->addr = addr;
+	i2c->read_chunk = MAX_READ_CHUNK;
+
+	if (ioctl(i2c->fd, I2C_FUNCS, &funcs) < 0
+	 || (funcs & I2C_FUNC_I2C))
+		return &i2c->be;
+
+	if ((funcs & SMBUS_BLOCK_FUNCS) == SMBUS_BLOCK_FUNCS) {
+		i2c->be.name = "smbus-block";
+		i2c->be.max_write = SMBUS_BLOCK_WRITE;
+	}
+	else if ((funcs & SMBUS_BYTE_FUNCS) == SMBUS_BYTE_FUNCS) {
+		i2c->be.name = "smbus-byte";
+		i2c->be.max_write = 1;
+	}
+	else {
+		eeprom_error(err, eeprom_err_unsupported,
+			     "I2C adapter %s can do neither I2C nor the "
+			     "SMBus transfers needed to reach an EEPROM",
+			     path);
+		goto funcs_err;
+	}
+	i2c->be.ops = &eeprom_smbus_ops;
+
+	/* SMBus transfers go to the address set here */
+	if (ioctl(i2c->fd, I2C_SLAVE, addr) < 0) {
+		if (errno == EBUSY)
+			eeprom_error(err, eeprom_err_bus,
+				     "EEPROM at 0x%02x is in use by a kernel "
+				     "driver; use its sysfs eeprom file "
+				     "instead", addr);
+		else
+			eeprom_syserror(err, eeprom_err_bus,
+					"Unable to set i2c address");
+		goto funcs_err;
+	}
+
+	return &i2c->be;
+
+funcs_err:
+	close(i2c->fd);
+open_err:
+	free(i2c);
+malloc_err:
+	return NULL;
+}
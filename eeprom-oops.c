@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+#include "eeprom-oops.h"
+#include "crc32.h"
+#include "lz.h"
+
+#define OOPS_HEADER_SIZE sizeof(struct novena_oops_record)
+
+/* Space a record takes up in the ring, including alignment padding */
+static uint32_t oops_record_size(const struct novena_oops_record *record) {
+	uint32_t size = OOPS_HEADER_SIZE + record->length;
+
+	return (size + NOVENA_OOPS_ALIGN - 1) & ~(NOVENA_OOPS_ALIGN - 1);
+}
+
+static uint32_t oops_record_crc(const struct novena_oops_record *record,
+				const void *payload) {
+	uint32_t crc;
+
+	crc = crc32(0, record, offsetof(struct novena_oops_record, crc));
+	return crc32(crc, payload, record->length);
+}
+
+/*
+ * Hand a record to fn, decompressing it on the way if need be.  Records
+ * that don't decompress are counted in cursor and skipped.  If fn asks
+ * to stop, that is recorded as the device's error.
+ */
+static int oops_deliver(struct eeprom_dev *dev,
+			struct eeprom_oops_cursor *cursor,
+			eeprom_oops_fn fn, void *arg,
+			const struct novena_oops_record *record,
+			const void *payload) {
+	uint8_t text[65535];
+	int len;
+	int ret;
+
+	if (!(record->flags & oops_lz4))
+		ret = fn(arg, record, payload, record->length);
+	else {
+		len = lz_decompress(payload, record->length, text,
+				    sizeof(text));
+		if (len < 0) {
+			cursor->skipped++;
+			return 0;
+		}
+		ret = fn(arg, record, text, len);
+	}
+
+	if (ret)
+		return eeprom_error(&dev->error, eeprom_err_stopped,
+				    "Stopped reading oops records at "
+				    "sequence %u", record->sequence);
+	return 0;
+}
+
+/* True if a is a later sequence number than b, allowing for wrap */
+static int oops_newer(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) > 0;
+}
+
+/* Find the ring described by the header */
+static int oops_area(struct eeprom_dev *dev, uint32_t *start, uint32_t *end) {
+	struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
+
+	if (eeprom_read(dev))
+		return 1;
+
+	if (memcmp(v2->signature, NOVENA_SIGNATURE, sizeof(v2->signature))
+	 || v2->version < 2
+	 || !(v2->features & feature_eepromoops)
+	 || v2->eepromoops_length < OOPS_HEADER_SIZE)
+		return eeprom_error(&dev->error, eeprom_err_not_found,
+				    "The EEPROM has no eepromoops area");
+
+	*start = v2->eepromoops_offset;
+	*end = v2->eepromoops_offset + v2->eepromoops_length;
+	return 0;
+}
+
+/*
+ * Carry on from the cursor, reading one header at a time, for as long
+ * as the next record is the one expected.  Returns -1 if the cursor has
+ * been lapped by the writer, so the whole ring needs scanning.
+ */
+static int oops_read_from(struct eeprom_dev *dev, uint32_t start, uint32_t end,
+			  struct eeprom_oops_cursor *cursor,
+			  eeprom_oops_fn fn, void *arg) {
+	struct novena_oops_record record;
+	uint8_t payload[65536];
+	uint32_t offset = cursor->offset;
+	int wrapped = 0;
+
+	if (offset < start || offset >= end)
+		return -1;
+
+	while (1) {
+		uint32_t expected = cursor->sequence + 1;
+
+		if (offset + OOPS_HEADER_SIZE > end)
+			goto wrap;
+
+		if (eeprom_read_at(dev, offset, &record, sizeof(record)))
+			return 1;
+
+		if (record.magic != NOVENA_OOPS_MAGIC
+		 || offset + oops_record_size(&record) > end)
+			goto wrap;
+
+		if (oops_newer(record.sequence, expected))
+			return -1;
+		if (record.sequence != expected)
+			goto wrap;
+
+		if (eeprom_read_at(dev, offset + OOPS_HEADER_SIZE, payload,
+				   record.length))
+			return 1;
+
+		/* Half-written, perhaps because the writer lost power */
+		if (record.crc != oops_record_crc(&record, payload))
+			return 0;
+
+		if (oops_deliver(dev, cursor, fn, arg, &record, payload))
+			return 1;
+
+		offset += oops_record_size(&record);
+		cursor->sequence = record.sequence;
+		cursor->offset = offset < end ? offset : start;
+		wrapped = 0;
+		continue;
+
+wrap:
+		/* The next record may have gone back to the start */
+		if (wrapped || offset == start)
+			return 0;
+		offset = start;
+		wrapped = 1;
+	}
+}
+
+struct oops_found {
+	uint32_t			offset;
+	uint32_t			sequence;
+};
+
+static int oops_found_cmp(const void *a, const void *b) {
+	const struct oops_found *fa = a, *fb = b;
+
+	if (fa->sequence == fb->sequence)
+		return 0;
+	return oops_newer(fa->sequence, fb->sequence) ? 1 : -1;
+}
+
+/*
+ * Read the whole ring and look for intact records at every aligned
+ * offset, as records from earlier passes around the ring need not line
+ * up with the newer ones.
+ */
+static int oops_scan(struct eeprom_dev *dev, uint32_t start, uint32_t end,
+		     struct eeprom_oops_cursor *cursor,
+		     eeprom_oops_fn fn, void *arg) {
+	struct oops_found *found = NULL;
+	uint32_t size = end - start;
+	int nfound = 0;
+	uint32_t offset;
+	uint8_t *area;
+	int ret = 1;
+	int i;
+
+	area = malloc(size);
+	found = malloc((size / NOVENA_OOPS_ALIGN + 1) * sizeof(*found));
+	if (!area || !found) {
+		eeprom_error(&dev->error, eeprom_err_nomem,
+			     "Unable to alloc data");
+		goto out;
+	}
+
+	if (eeprom_read_at(dev, start, area, size))
+		goto out;
+
+	for (offset = 0; offset + OOPS_HEADER_SIZE <= size; ) {
+		struct novena_oops_record record;
+
+		memcpy(&record, area + offset, sizeof(record));
+		if (record.magic != NOVENA_OOPS_MAGIC
+		 || offset + oops_record_size(&record) > size
+		 || record.crc != oops_record_crc(&record,
+					area + offset + OOPS_HEADER_SIZE)) {
+			offset += NOVENA_OOPS_ALIGN;
+			continue;
+		}
+
+		found[nfound].offset = offset;
+		found[nfound].sequence = record.sequence;
+		nfound++;
+		offset += oops_record_size(&record);
+	}
+
+	qsort(found, nfound, sizeof(*found), oops_found_cmp);
+
+	for (i = 0; i < nfound && cursor->valid; i++) {
+		if (!oops_newer(found[i].sequence, cursor->sequence))
+			continue;
+		cursor->lost = found[i].sequence - cursor->sequence - 1;
+		break;
+	}
+
+	for (i = 0; i < nfound; i++) {
+		struct novena_oops_record record;
+		uint32_t next;
+
+		memcpy(&record, area + found[i].offset, sizeof(record));
+		if (cursor->valid && !oops_newer(record.sequence,
+						 cursor->sequence))
+			continue;
+
+		if (oops_deliver(dev, cursor, fn, arg, &record,
+				 area + found[i].offset + OOPS_HEADER_SIZE))
+			goto out;
+
+		next = found[i].offset + oops_record_size(&record);
+		cursor->valid = 1;
+		cursor->sequence = record.sequence;
+		cursor->offset = start + (next < size ? next : 0);
+	}
+
+	ret = 0;
+
+out:
+	free(area);
+	free(found);
+	return ret;
+}
+
+int eeprom_oops_read(struct eeprom_dev *dev, struct eeprom_oops_cursor *cursor,
+		     eeprom_oops_fn fn, void *arg) {
+	uint32_t start, end;
+	int ret;
+
+	cursor->lost = 0;
+	cursor->skipped = 0;
+
+	if (oops_area(dev, &start, &end))
+		return 1;
+
+	if (cursor->valid) {
+		ret = oops_read_from(dev, start, end, cursor, fn, arg);
+		if (ret >= 0)
+			return ret;
+	}
+
+	return oops_scan(dev, start, end, cursor, fn, arg);
+}
+
+static int oops_ignore(void *arg, const struct novena_oops_record *record,
+		       const void *payload, uint32_t len) {
+	(void)arg;
+	(void)record;
+	(void)payload;
+	(void)len;
+	return 0;
+}
+
+/*
+ * Find where the next record goes, leaving it in cursor.  The newest
+ * pass around the ring always starts at the start of the area, so
+ * following the headers from there finds the head without reading any
+ * payloads.  Only the last record can have been cut short, so only its
+ * CRC needs checking.  If the first record is missing or damaged, fall
+ * back to scanning the whole area.
+ */
+static int oops_find_head(struct eeprom_dev *dev, uint32_t start,
+			  uint32_t end, struct eeprom_oops_cursor *cursor) {
+	struct novena_oops_record record;
+	struct novena_oops_record last;
+	uint32_t offset = start;
+	uint32_t last_offset = start;
+	uint8_t *payload;
+	int found = 0;
+
+	while (offset + OOPS_HEADER_SIZE <= end) {
+		if (eeprom_read_at(dev, offset, &record, sizeof(record)))
+			return 1;
+
+		if (record.magic != NOVENA_OOPS_MAGIC
+		 || offset + oops_record_size(&record) > end
+		 || (found && record.sequence != last.sequence + 1))
+			break;
+
+		last = record;
+		last_offset = offset;
+		found = 1;
+		offset += oops_record_size(&record);
+	}
+
+	if (!found) {
+		memset(cursor, 0, sizeof(*cursor));
+		if (oops_scan(dev, start, end, cursor, oops_ignore, NULL))
+			return 1;
+		if (!cursor->valid) {
+			cursor->valid = 1;
+			cursor->offset = start;
+		}
+		return 0;
+	}
+
+	payload = malloc(last.length + 1);
+	if (!payload)
+		return eeprom_error(&dev->error, eeprom_err_nomem,
+				    "Unable to alloc data");
+	if (eeprom_read_at(dev, last_offset + OOPS_HEADER_SIZE, payload,
+			   last.length)) {
+		free(payload);
+		return 1;
+	}
+
+	/* A record cut short gets written over */
+	cursor->valid = 1;
+	if (last.crc == oops_record_crc(&last, payload)) {
+		cursor->sequence = last.sequence;
+		cursor->offset = offset;
+	}
+	else {
+		cursor->sequence = last.sequence - 1;
+		cursor->offset = last_offset;
+	}
+
+	free(payload);
+	return 0;
+}
+
+int eeprom_oops_append(struct eeprom_dev *dev, const struct iovec *records,
+		       int count) {
+	struct eeprom_oops_cursor head;
+	uint32_t start, end;
+	uint32_t offset, used = 0;
+	uint8_t *buffer;
+	uint8_t *packed;
+	int pages = 0;
+	int ret = 1;
+	int i;
+
+	if (oops_area(dev, &start, &end))
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		if (records[i].iov_len > 0xffff
+		 || OOPS_HEADER_SIZE + records[i].iov_len > end - start)
+			return eeprom_error(&dev->error, eeprom_err_no_space,
+					    "Oops record of %zu bytes is too "
+					    "big for the %u-byte eepromoops "
+					    "area", records[i].iov_len,
+					    end - start);
+	}
+
+	if (oops_find_head(dev, start, end, &head))
+		return 1;
+
+	buffer = malloc(end - start);
+	packed = malloc(0xffff);
+	if (!buffer || !packed) {
+		eeprom_error(&dev->error, eeprom_err_nomem,
+			     "Unable to alloc data");
+		goto out;
+	}
+
+	dev->oops_bytes = 0;
+	dev->oops_bytes_stored = 0;
+
+	offset = head.offset;
+	for (i = 0; i < count; i++) {
+		struct novena_oops_record record;
+		const void *payload = records[i].iov_base;
+		uint32_t size;
+		int len;
+
+		record.magic = NOVENA_OOPS_MAGIC;
+		record.sequence = ++head.sequence;
+		record.timestamp = time(NULL);
+		record.length = records[i].iov_len;
+		record.flags = 0;
+
+		/* Only keep the compressed copy if it's actually smaller */
+		len = lz_compress(payload, record.length, packed,
+				  record.length - 1);
+		if (len > 0) {
+			payload = packed;
+			record.length = len;
+			record.flags |= oops_lz4;
+		}
+
+		record.crc = oops_record_crc(&record, payload);
+		size = oops_record_size(&record);
+		dev->oops_bytes += records[i].iov_len;
+		dev->oops_bytes_stored += record.length;
+
+		/* Go back to the start once the end of the area is reached */
+		if (offset + used + size > end) {
+			if (used) {
+				if (eeprom_write_at(dev, offset, buffer, NULL,
+						    used))
+					goto out;
+				pages += dev->pages_written;
+			}
+			offset = start;
+			used = 0;
+		}
+
+		memcpy(buffer + used, &record, sizeof(record));
+		memcpy(buffer + used + sizeof(record), payload, record.length);
+		memset(buffer + used + sizeof(record) + record.length, 0,
+		       size - sizeof(record) - record.length);
+		used += size;
+	}
+
+	if (used && eeprom_write_at(dev, offset, buffer, NULL, used))
+		goto out;
+
+	dev->pages_written += pages;
+	ret = 0;
+
+out:
+	free(buffer);
+	free(packed);
+	return ret;
+}
+
+int eeprom_oops_cursor_load(const char *path,
+			    struct eeprom_oops_cursor *cursor,
+			    struct eeprom_error *err) {
+	FILE *f;
+
+	memset(cursor, 0, sizeof(*cursor));
+
+	f = fopen(path, "r");
+	if (NULL == f) {
+		if (errno == ENOENT)
+			return 0;
+		return eeprom_syserror(err, eeprom_err_system,
+				       "Unable to open oops cursor %s", path);
+	}
+
+	if (fscanf(f, "%u %i", &cursor->sequence, &cursor->offset) == 2)
+		cursor->valid = 1;
+
+	fclose(f);
+	return 0;
+}
+
+/* Write a new file and rename it, so a crash never loses the cursor */
+int eeprom_oops_cursor_save(const char *path,
+			    const struct eeprom_oops_cursor *cursor,
+			    struct eeprom_error *err) {
+	size_t len = strlen(path) + 8;
+	char *tmp;
+	FILE *f;
+
+	if (!cursor->valid)
+		return 0;
+
+	tmp = malloc(len);
+	if (!tmp)
+		return eeprom_error(err, eeprom_err_nomem,
+				    "Unable to alloc data");
+	snprintf(tmp, len, "%s.new", path);
+
+	f = fopen(tmp, "w");
+	if (NULL == f) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to save oops cursor %s", path);
+		free(tmp);
+		return 1;
+	}
+
+	fprintf(f, "%u 0x%04x\n", cursor->sequence, cursor->offset);
+	if (fclose(f) || rename(tmp, path)) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to save oops cursor %s", path);
+		unlink(tmp);
+		free(tmp);
+		return 1;
+	}
+
+	free(tmp);
+	return 0;
+}
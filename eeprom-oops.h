@@ -0,0 +1,70 @@
+#ifndef __EEPROM_OOPS_H__
+#define __EEPROM_OOPS_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "eeprom.h"
+
+#pragma GCC visibility push(default)
+
+/*
+ * How far a reader has got through the oops ring: the last record it
+ * saw, and where the record after it will start.
+ */
+struct eeprom_oops_cursor {
+	int				valid;
+	uint32_t			sequence;
+	uint32_t			offset;
+
+	/* Records the last eeprom_oops_read() found were overwritten
+	 * before they could be read, and records it skipped as they
+	 * didn't decompress */
+	uint32_t			lost;
+	uint32_t			skipped;
+};
+
+/*
+ * Called for each record, in sequence order, with the payload already
+ * decompressed to len bytes.  record->length is the size as stored.
+ */
+typedef int (*eeprom_oops_fn)(void *arg,
+			      const struct novena_oops_record *record,
+			      const void *payload, uint32_t len);
+
+/*
+ * Hand every record newer than cursor to fn, then move cursor past
+ * them.  With a valid cursor, only the new records are read from the
+ * chip; the whole area is only read if the cursor has been lapped or
+ * lost.  A nonzero return from fn stops the walk, and makes this fail
+ * with eeprom_err_stopped; the cursor is left just past the last record
+ * fn accepted.
+ */
+int eeprom_oops_read(struct eeprom_dev *dev, struct eeprom_oops_cursor *cursor,
+		     eeprom_oops_fn fn, void *arg);
+
+/*
+ * Append count records, each payload given by an iovec, after the
+ * newest record on the chip.  Each is compressed, unless that doesn't
+ * make it any smaller.  The records are packed together and
+ * written in one go, costing a single write cycle per page touched.
+ * Only record headers are read to find the newest record, and no page
+ * is ever read, modified and written back.
+ */
+int eeprom_oops_append(struct eeprom_dev *dev, const struct iovec *records,
+		       int count);
+
+/*
+ * A cursor file that doesn't exist yet, or is damaged, loads as an
+ * invalid cursor.  Failures are recorded in err.
+ */
+int eeprom_oops_cursor_load(const char *path,
+			    struct eeprom_oops_cursor *cursor,
+			    struct eeprom_error *err);
+int eeprom_oops_cursor_save(const char *path,
+			    const struct eeprom_oops_cursor *cursor,
+			    struct eeprom_error *err);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_OOPS_H__ */
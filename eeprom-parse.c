@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "eeprom.h"
+
+const struct available_modesetting_flags eeprom_modesetting_flags[] = {
+	{
+		.name	= "channel_present",
+		.flags	= channel_present,
+		.descr	= "This channel is present",
+	},
+	{
+		.name	= "dual_channel",
+		.flags	= dual_channel,
+		.descr	= "Channel is dual-lane",
+	},
+	{
+		.name	= "vsync_polarity",
+		.flags	= vsync_polarity,
+		.descr	= "VSync polarity is positive",
+	},
+	{
+		.name	= "hsync_polarity",
+		.flags	= hsync_polarity,
+		.descr	= "HSync polarity is positive",
+	},
+	{
+		.name	= "mapping_jeida",
+		.flags	= mapping_jeida,
+		.descr	= "Use JEIDA (as opposed to PSWG) mapping",
+	},
+	{
+		.name	= "data_width_8bit",
+		.flags	= data_width_8bit,
+		.descr	= "Use 8-bit (as opposed to 6 [LVDS] or 10 [HDMI] bit)",
+	},
+	{
+		.name	= "ignore_settings",
+		.flags	= ignore_settings,
+		.descr	= "Ignore settings and attempt to auto-detect",
+	},
+	{} /* Sentinal */
+};
+
+const struct feature eeprom_features[] = {
+	{
+		.name	= "es8328",
+		.flags	= feature_es8328,
+		.descr	= "ES8328 audio codec",
+	},
+	{
+		.name	= "senoko",
+		.flags	= feature_senoko,
+		.descr	= "Senoko battery board",
+	},
+	{
+		.name	= "edp",
+		.flags	= feature_retina,
+		.descr	= "eDP bridge chip",
+	},
+	{
+		.name	= "pixelqi",
+		.flags	= feature_pixelqi,
+		.descr	= "PixelQi LVDS display (deprecated)",
+	},
+	{
+		.name	= "pcie",
+		.flags	= feature_pcie,
+		.descr	= "PCI Express support",
+	},
+	{
+		.name	= "gbit",
+		.flags	= feature_gbit,
+		.descr	= "Gigabit Ethernet",
+	},
+	{
+		.name	= "hdmi",
+		.flags	= feature_hdmi,
+		.descr	= "HDMI Output (deprecated)",
+	},
+	{
+		.name	= "eepromoops",
+		.flags	= feature_eepromoops,
+		.descr	= "EEPROM Oops storage",
+	},
+	{
+		.name	= "sataroot",
+		.flags	= feature_rootsrc_sata,
+		.descr	= "Root device is SATA",
+	},
+	{
+		.name	= "heirloom",
+		.flags	= feature_heirloom,
+		.descr	= "Laptop is an Heirloom model",
+	},
+	{
+		.name	= "lidbootblock",
+		.flags	= feature_lidbootblock,
+		.descr	= "Prevent booting when lid is shut",
+	},
+	{} /* Sentinal */
+};
+
+/*
+ * Words are matched in place rather than with strtok(), so the string
+ * is left alone and this can be called from any thread.
+ */
+int eeprom_parse_features(const char *str, uint16_t *flags,
+			  struct eeprom_error *err) {
+	uint16_t found = 0;
+
+	while (*str) {
+		const struct feature *feature = eeprom_features;
+		size_t len = strcspn(str, ",");
+
+		while (len && feature->name) {
+			if (strlen(feature->name) == len
+			 && !strncmp(feature->name, str, len)) {
+				found |= feature->flags;
+				break;
+			}
+			feature++;
+		}
+		if (len && !feature->name)
+			return eeprom_error(err, eeprom_err_invalid,
+					    "Unrecognized feature \"%.*s\"",
+					    (int)len, str);
+
+		str += len;
+		if (*str)
+			str++;
+	}
+
+	*flags = found;
+	return 0;
+}
+
+int eeprom_parse_modesetting(struct modesetting *m, const char *arg,
+			     struct eeprom_error *err) {
+	int len = 0;
+	float mhz;
+	uint32_t h1, h2, h3, h4;
+	uint32_t v1, v2, v3, v4;
+	char *ctx;
+
+	if (sscanf(arg, "%*s %*s %f %u %u %u %u %u %u %u %d %n",
+		   &mhz, &h1, &h2, &h3, &h4, &v1, &v2, &v3, &v4, &len) < 9)
+		return eeprom_error(err, eeprom_err_invalid,
+				    "Unable to parse modeline \"%s\"", arg);
+
+	m->frequency = mhz * 1000000;
+
+	m->hactive = h1;
+	m->hback_porch = h2 - m->hactive;
+	m->hfront_porch = h3 - m->hactive - m->hback_porch;
+	m->hsync_len = h4 - m->hactive - m->hback_porch - m->hfront_porch;
+
+	m->vactive = v1;
+	m->vback_porch = v2 - m->vactive;
+	m->vfront_porch = v3 - m->vactive - m->vback_porch;
+	m->vsync_len = v4 - m->vactive - m->vback_porch - m->vfront_porch;
+
+	m->flags = 0;
+
+	char flagstr[strlen(arg + len) + 1];
+	char *flag;
+	char *tmp = flagstr;
+
+	memcpy(flagstr, arg + len, sizeof(flagstr));
+
+	while ((flag = strtok_r(tmp, " ", &ctx)) != NULL) {
+		tmp = NULL;
+
+		if (!strcasecmp(flag, "+hsync"))
+			m->flags |= hsync_polarity;
+		else if (!strcasecmp(flag, "-hsync"))
+			m->flags &= ~hsync_polarity;
+		else if (!strcasecmp(flag, "+vsync"))
+			m->flags |= vsync_polarity;
+		else if (!strcasecmp(flag, "-vsync"))
+			m->flags &= ~vsync_polarity;
+		else {
+			const struct available_modesetting_flags *feature;
+
+			for (feature = eeprom_modesetting_flags;
+			     feature->name;
+			     feature++) {
+				if (!strcasecmp(feature->name, flag)) {
+					m->flags |= feature->flags;
+					break;
+				}
+			}
+		}
+
+	}
+
+	return 0;
+}
+
+int eeprom_parse_mac(const char *str, void *out, struct eeprom_error *err) {
+	int i;
+	char *mac = out;
+	for (i=0; i<6; i++) {
+		if (!isxdigit((unsigned char)str[0])
+		 || !isxdigit((unsigned char)str[1]))
+			return eeprom_error(err, eeprom_err_invalid,
+					    "Unable to parse MAC address");
+
+		*mac = strtoul(str, NULL, 16);
+		mac++;
+		str+=2;
+		if (*str == '-' || *str == ':' || *str == '.')
+			str++;
+	}
+	if (*str)
+		return eeprom_error(err, eeprom_err_invalid,
+				    "Unable to parse MAC address");
+	return 0;
+}
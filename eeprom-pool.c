@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "eeprom-pool.h"
+
+struct eeprom_pool {
+	pthread_mutex_t		lock;
+
+	/* Next job to hand out, and how many there are */
+	int			next_job;
+	int			njobs;
+
+	void			(*fn)(void *arg, int job);
+	void			*arg;
+};
+
+static void *eeprom_pool_worker(void *data) {
+	struct eeprom_pool *pool = data;
+
+	while (1) {
+		int job;
+
+		pthread_mutex_lock(&pool->lock);
+		job = pool->next_job++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job >= pool->njobs)
+			break;
+
+		pool->fn(pool->arg, job);
+	}
+
+	return NULL;
+}
+
+int eeprom_pool_run(int nworkers, int njobs,
+		    void (*fn)(void *arg, int job), void *arg) {
+	struct eeprom_pool pool;
+	pthread_t *threads;
+	int started;
+	int ret;
+
+	if (nworkers > njobs)
+		nworkers = njobs;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	threads = malloc(nworkers * sizeof(*threads));
+	if (!threads)
+		return ENOMEM;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.njobs = njobs;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	for (started = 0; started < nworkers; started++) {
+		ret = pthread_create(&threads[started], NULL,
+				     eeprom_pool_worker, &pool);
+		if (ret)
+			break;
+	}
+
+	/* Jobs still all get run, as long as one worker got going */
+	if (!started) {
+		pthread_mutex_destroy(&pool.lock);
+		free(threads);
+		return ret;
+	}
+
+	while (started--)
+		pthread_join(threads[started], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef __EEPROM_POOL_H__
+#define __EEPROM_POOL_H__
+
+#pragma GCC visibility push(default)
+
+/*
+ * Run fn(arg, job) for every job in 0..njobs-1, spread across up to
+ * nworkers threads.  Each job runs exactly once; the order in which
+ * jobs start is not defined.  Returns an errno value if the pool could
+ * not be started, in which case no jobs have run.
+ */
+int eeprom_pool_run(int nworkers, int njobs,
+		    void (*fn)(void *arg, int job), void *arg);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_POOL_H__ */
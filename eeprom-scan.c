@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+
+#include "novena-eeprom.h"
+#include "eeprom-backend.h"
+#include "eeprom-pool.h"
+#include "eeprom-scan.h"
+
+#define SCAN_ADDRS (SCAN_LAST_ADDR - SCAN_FIRST_ADDR + 1)
+
+/* What one worker found on its bus */
+struct bus_scan {
+	const char			*path;
+	struct eeprom_scan_hit		hits[SCAN_ADDRS];
+	int				nhits;
+
+	/* Nonzero to read SMBus-only adapters too */
+	int				smbus;
+
+	/* errno from opening the bus, or 0 if it could be scanned */
+	int				open_errno;
+};
+
+/* The signature and version, which every header version starts with */
+struct scan_id {
+	char				signature[6];
+	uint8_t				version;
+};
+
+/* The number at the end of a path like /dev/i2c-10, or -1 if none */
+static int bus_number(const char *path) {
+	const char *end = path + strlen(path);
+	const char *p = end;
+
+	while (p > path && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	return p == end ? -1 : atoi(p);
+}
+
+/* glob() sorts i2c-10 before i2c-2, so put the buses in numeric order */
+static int compare_buses(const void *a, const void *b) {
+	const struct bus_scan *x = a;
+	const struct bus_scan *y = b;
+	int nx = bus_number(x->path);
+	int ny = bus_number(y->path);
+
+	if (nx != ny)
+		return nx < ny ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+static void scan_bus(void *arg, int job) {
+	struct bus_scan *bus = (struct bus_scan *)arg + job;
+	int addr;
+	int fd;
+
+	fd = open(bus->path, O_RDWR);
+	if (fd == -1) {
+		bus->open_errno = errno;
+		return;
+	}
+
+	for (addr = SCAN_FIRST_ADDR; addr <= SCAN_LAST_ADDR; addr++) {
+		struct eeprom_scan_hit *hit = &bus->hits[bus->nhits];
+		struct scan_id id;
+
+		/* Nothing there, or something that isn't an EEPROM */
+		if (eeprom_i2c_peek(fd, addr, bus->smbus, 0, &id, sizeof(id))
+		 || memcmp(id.signature, NOVENA_SIGNATURE,
+			   sizeof(id.signature)))
+			continue;
+
+		snprintf(hit->path, sizeof(hit->path), "%s", bus->path);
+		hit->addr = addr;
+		hit->version = id.version;
+		bus->nhits++;
+	}
+
+	close(fd);
+}
+
+int eeprom_scan(const char *pattern, int smbus,
+		struct eeprom_scan_hit **hits, int *nhits,
+		struct eeprom_error *err) {
+	struct bus_scan *buses;
+	glob_t paths;
+	size_t i;
+	int ret;
+
+	*hits = NULL;
+	*nhits = 0;
+
+	ret = glob(pattern, 0, NULL, &paths);
+	if (ret == GLOB_NOMATCH)
+		return 0;
+	if (ret)
+		return eeprom_error(err, eeprom_err_system,
+				    "Unable to list I2C buses matching %s",
+				    pattern);
+
+	ret = 1;
+	buses = calloc(paths.gl_pathc, sizeof(*buses));
+	*hits = calloc(paths.gl_pathc * SCAN_ADDRS, sizeof(**hits));
+	if (!buses || !*hits) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto out;
+	}
+
+	for (i = 0; i < paths.gl_pathc; i++) {
+		buses[i].path = paths.gl_pathv[i];
+		buses[i].smbus = smbus;
+	}
+	qsort(buses, paths.gl_pathc, sizeof(*buses), compare_buses);
+
+	ret = eeprom_pool_run(paths.gl_pathc, paths.gl_pathc, scan_bus, buses);
+	if (ret) {
+		errno = ret;
+		ret = eeprom_syserror(err, eeprom_err_system,
+				      "Unable to start worker threads");
+		goto out;
+	}
+
+	for (i = 0; i < paths.gl_pathc; i++) {
+		if (buses[i].open_errno) {
+			errno = buses[i].open_errno;
+			eeprom_syserror(err, eeprom_err_system,
+					"Unable to open %s", buses[i].path);
+		}
+		memcpy(*hits + *nhits, buses[i].hits,
+		       buses[i].nhits * sizeof(**hits));
+		*nhits += buses[i].nhits;
+	}
+	ret = 0;
+
+out:
+	if (ret) {
+		free(*hits);
+		*hits = NULL;
+	}
+	free(buses);
+	globfree(&paths);
+	return ret;
+}
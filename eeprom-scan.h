@@ -0,0 +1,39 @@
+#ifndef __EEPROM_SCAN_H__
+#define __EEPROM_SCAN_H__
+
+#include "eeprom-error.h"
+
+#pragma GCC visibility push(default)
+
+/* Buses looked at, and the addresses a 24-series EEPROM can answer on */
+#define SCAN_BUSES "/dev/i2c-*"
+#define SCAN_FIRST_ADDR 0x50
+#define SCAN_LAST_ADDR 0x57
+
+/* A Novena EEPROM found on one of the buses */
+struct eeprom_scan_hit {
+	char				path[64];
+	int				addr;
+	int				version;
+};
+
+/*
+ * Look for Novena EEPROMs at every likely address on every bus matching
+ * pattern, one thread per bus.  Only the signature and version of each
+ * chip are read.  Hits are returned in order of bus number, then
+ * address, in an array the caller frees.  Buses that can't be opened
+ * are skipped without failing the scan, though the last of them is
+ * noted in err.
+ *
+ * Nothing is written to a chip that a kernel driver has claimed or that
+ * doesn't answer a read.  Adapters that can only do SMBus have to set
+ * the address pointer with a plain write, so they are only scanned if
+ * smbus is set.
+ */
+int eeprom_scan(const char *pattern, int smbus,
+		struct eeprom_scan_hit **hits, int *nhits,
+		struct eeprom_error *err);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_SCAN_H__ */
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eeprom-backend.h"
+
+/* A 24C512, as fitted to Novena */
+#define SIM_DEFAULT_SIZE 65536
+#define SIM_DEFAULT_PAGE_SIZE 128
+#define SIM_DEFAULT_TWR_US 5000
+
+/* Model the i2c-dev limits: 8 KiB messages, 21 chunks per I2C_RDWR */
+#define SIM_DEFAULT_CHUNK 8192
+#define SIM_DEFAULT_PACK 21
+
+/* Bits on the wire per byte, including the ACK */
+#define I2C_BITS_PER_BYTE 9
+
+/*
+ * A simulated EEPROM, backed by an mmap'd file.  It behaves like a real
+ * part: writes that run off the end of a page wrap around to its start,
+ * addresses wrap at the end of the chip, and the part is busy (and NAKs
+ * everything) for tWR after each write.  Optionally the bus itself is
+ * modelled too: reads are split into chunk-sized messages, pack of them
+ * to a transaction, and each byte takes real time at the bus clock.
+ */
+struct eeprom_sim {
+	struct eeprom_backend		be;
+
+	/* File handle and mapping of the backing file */
+	int				fd;
+	uint8_t				*mem;
+
+	/* Chip geometry */
+	uint32_t			size;
+	uint32_t			page_size;
+
+	/* Length of the internal write cycle */
+	uint32_t			twr_us;
+
+	/* If zero, page writes run linearly rather than wrapping */
+	int				page_wrap;
+
+	/* Largest read message, and messages per transaction.  The
+	 * largest write, as on an SMBus-only adapter, is be.max_write. */
+	uint32_t			chunk;
+	uint32_t			pack;
+
+	/* Bus clock in kHz, or 0 for transfers that take no time */
+	uint32_t			khz;
+
+	/* Monotonic time, in ns, at which the current write cycle ends */
+	uint64_t			busy_until;
+};
+
+static uint64_t sim_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int sim_busy(struct eeprom_sim *sim) {
+	return sim_now_ns() < sim->busy_until;
+}
+
+/* Spend as long as it would take to clock bytes across the bus */
+static void sim_bus_delay(struct eeprom_sim *sim, uint32_t bytes) {
+	struct timespec delay;
+	uint64_t ns;
+
+	if (!sim->khz)
+		return;
+
+	ns = bytes * I2C_BITS_PER_BYTE * 1000000ULL / sim->khz;
+	delay.tv_sec = ns / 1000000000ULL;
+	delay.tv_nsec = ns % 1000000000ULL;
+	nanosleep(&delay, NULL);
+}
+
+static int eeprom_read_sim(struct eeprom_backend *be, uint32_t offset,
+			   void *data, uint32_t count) {
+	struct eeprom_sim *sim = (struct eeprom_sim *)be;
+	uint8_t *buf = data;
+	uint64_t start = eeprom_txn_start();
+	uint32_t chunks;
+	uint32_t i;
+	int attempt;
+
+	be->transactions++;
+	for (attempt = 0; sim_busy(sim); attempt++) {
+		sim_bus_delay(sim, 1);
+		eeprom_txn_record(be, eeprom_txn_read, start, 0, 1);
+		if (!eeprom_backend_retry(be, eeprom_txn_read, attempt,
+					  EREMOTEIO)) {
+			errno = EREMOTEIO;
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with simulated device");
+		}
+		start = eeprom_txn_start();
+		be->transactions++;
+	}
+
+	/* Each chunk costs an address-set write and a read header */
+	chunks = (count + sim->chunk - 1) / sim->chunk;
+	if (chunks > sim->pack)
+		be->transactions += (chunks + sim->pack - 1) / sim->pack - 1;
+	sim_bus_delay(sim, count + chunks * 4);
+
+	for (i = 0; i < count; i++)
+		buf[i] = sim->mem[(offset + i) % sim->size];
+
+	eeprom_txn_record(be, eeprom_txn_read, start, count, 0);
+	return 0;
+}
+
+static int eeprom_write_sim(struct eeprom_backend *be, uint32_t offset,
+			    const void *data, uint32_t count) {
+	struct eeprom_sim *sim = (struct eeprom_sim *)be;
+	const uint8_t *buf = data;
+	uint32_t page = offset - (offset % sim->page_size);
+	uint64_t start = eeprom_txn_start();
+	uint32_t i;
+	int attempt;
+
+	be->transactions++;
+	for (attempt = 0; sim_busy(sim); attempt++) {
+		sim_bus_delay(sim, 1);
+		eeprom_txn_record(be, eeprom_txn_write, start, 0, 1);
+		if (!eeprom_backend_retry(be, eeprom_txn_write, attempt,
+					  EREMOTEIO)) {
+			errno = EREMOTEIO;
+			return eeprom_syserror(be->error, eeprom_err_bus,
+				"Unable to communicate with simulated device");
+		}
+		start = eeprom_txn_start();
+		be->transactions++;
+	}
+
+	sim_bus_delay(sim, count + 3);
+
+	for (i = 0; i < count; i++) {
+		uint32_t addr;
+
+		if (sim->page_wrap)
+			addr = page + ((offset - page + i) % sim->page_size);
+		else
+			addr = offset + i;
+		sim->mem[addr % sim->size] = buf[i];
+	}
+
+	eeprom_txn_record(be, eeprom_txn_write, start, count, 0);
+	sim->busy_until = sim_now_ns() + sim->twr_us * 1000ULL;
+	return 0;
+}
+
+static int eeprom_ready_sim(struct eeprom_backend *be) {
+	struct eeprom_sim *sim = (struct eeprom_sim *)be;
+	uint64_t start = eeprom_txn_start();
+
+	be->transactions++;
+	if (sim_busy(sim)) {
+		sim_bus_delay(sim, 1);
+		eeprom_txn_record(be, eeprom_txn_poll, start, 0, 1);
+		return 1;
+	}
+	sim_bus_delay(sim, 3);
+	eeprom_txn_record(be, eeprom_txn_poll, start, 0, 0);
+	return 0;
+}
+
+static void eeprom_close_sim(struct eeprom_backend *be) {
+	struct eeprom_sim *sim = (struct eeprom_sim *)be;
+
+	munmap(sim->mem, sim->size);
+	close(sim->fd);
+	free(sim);
+}
+
+static const struct eeprom_backend_ops eeprom_sim_ops = {
+	.read	= eeprom_read_sim,
+	.write	= eeprom_write_sim,
+	.ready	= eeprom_ready_sim,
+	.close	= eeprom_close_sim,
+};
+
+/*
+ * Parse "file[,size=N][,page=N][,twr=us][,nowrap][,khz=N][,chunk=N]
+ * [,pack=N][,write=N]".  Returns a copy of the filename, which the
+ * caller must free.
+ */
+static char *sim_parse_spec(struct eeprom_sim *sim, const char *spec,
+			    struct eeprom_error *err) {
+	char *str;
+	char *ctx;
+	char *sep = ",";
+	char *word;
+	char *filename;
+
+	str = strdup(spec);
+	if (!str) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		return NULL;
+	}
+
+	filename = strtok_r(str, sep, &ctx);
+	if (!filename || !*filename) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "No file given for simulated EEPROM");
+		free(str);
+		return NULL;
+	}
+
+	while ((word = strtok_r(NULL, sep, &ctx)) != NULL) {
+		if (!strncmp(word, "size=", 5))
+			sim->size = strtoul(word + 5, NULL, 0);
+		else if (!strncmp(word, "page=", 5))
+			sim->page_size = strtoul(word + 5, NULL, 0);
+		else if (!strncmp(word, "twr=", 4))
+			sim->twr_us = strtoul(word + 4, NULL, 0);
+		else if (!strcmp(word, "nowrap"))
+			sim->page_wrap = 0;
+		else if (!strncmp(word, "khz=", 4))
+			sim->khz = strtoul(word + 4, NULL, 0);
+		else if (!strncmp(word, "chunk=", 6))
+			sim->chunk = strtoul(word + 6, NULL, 0);
+		else if (!strncmp(word, "pack=", 5))
+			sim->pack = strtoul(word + 5, NULL, 0);
+		else if (!strncmp(word, "write=", 6))
+			sim->be.max_write = strtoul(word + 6, NULL, 0);
+		else {
+			eeprom_error(err, eeprom_err_invalid,
+				     "Unrecognized simulator option \"%s\"",
+				     word);
+			free(str);
+			return NULL;
+		}
+	}
+
+	if (!sim->size || !sim->page_size || !sim->chunk || !sim->pack) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "Simulated EEPROM size, page size, chunk and "
+			     "pack must be nonzero");
+		free(str);
+		return NULL;
+	}
+
+	/* The filename is at the start of the buffer, so just hand it back */
+	return str;
+}
+
+struct eeprom_backend *eeprom_sim_open(const char *spec,
+				       struct eeprom_error *err) {
+	struct eeprom_sim *sim;
+	struct stat st;
+	char *filename;
+
+	sim = malloc(sizeof(*sim));
+	if (!sim) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto malloc_err;
+	}
+
+	memset(sim, 0, sizeof(*sim));
+	sim->size = SIM_DEFAULT_SIZE;
+	sim->page_size = SIM_DEFAULT_PAGE_SIZE;
+	sim->twr_us = SIM_DEFAULT_TWR_US;
+	sim->page_wrap = 1;
+	sim->chunk = SIM_DEFAULT_CHUNK;
+	sim->pack = SIM_DEFAULT_PACK;
+
+	filename = sim_parse_spec(sim, spec, err);
+	if (!filename)
+		goto parse_err;
+
+	sim->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (sim->fd == -1) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to open simulated EEPROM file %s",
+				filename);
+		goto open_err;
+	}
+
+	if (fstat(sim->fd, &st) == -1) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to stat simulated EEPROM file");
+		goto stat_err;
+	}
+
+	/* Never throw away the end of a file made for a bigger part */
+	if (st.st_size > sim->size) {
+		eeprom_error(err, eeprom_err_invalid,
+			     "Simulated EEPROM file %s is %lld bytes, larger "
+			     "than size=%u", filename, (long long)st.st_size,
+			     sim->size);
+		goto stat_err;
+	}
+
+	if (st.st_size < sim->size && ftruncate(sim->fd, sim->size) == -1) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to size simulated EEPROM file");
+		goto stat_err;
+	}
+
+	sim->mem = mmap(NULL, sim->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			sim->fd, 0);
+	if (sim->mem == MAP_FAILED) {
+		eeprom_syserror(err, eeprom_err_system,
+				"Unable to map simulated EEPROM file");
+		goto stat_err;
+	}
+
+	/* Newly-created areas of the chip start out erased */
+	if (st.st_size < sim->size)
+		memset(sim->mem + st.st_size, 0xff, sim->size - st.st_size);
+
+	sim->be.name = "sim";
+	sim->be.error = err;
+	sim->be.ops = &eeprom_sim_ops;
+
+	free(filename);
+	return &sim->be;
+
+stat_err:
+	close(sim->fd);
+open_err:
+	free(filename);
+parse_err:
+	free(sim);
+malloc_err:
+	return NULL;
+}
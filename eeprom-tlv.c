@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "eeprom.h"
+#include "crc32.h"
+
+/* Read the record index, returning nonzero if it is missing or damaged */
+static int tlv_read_index(struct eeprom_dev *dev,
+			  struct novena_tlv_index *index) {
+	if (eeprom_read_at(dev, NOVENA_TLV_INDEX_OFFSET, index, sizeof(*index)))
+		return -1;
+
+	if (memcmp(index->magic, NOVENA_TLV_MAGIC, sizeof(index->magic))
+	 || index->crc != crc32(0, index, offsetof(struct novena_tlv_index, crc))
+	 || index->count > NOVENA_TLV_MAX_RECORDS
+	 || index->area_end < NOVENA_TLV_RECORDS_OFFSET)
+		return 1;
+
+	return 0;
+}
+
+/* Check that a record read from the chip is intact and has the given key */
+static int tlv_record_matches(const struct novena_tlv_entry *entry,
+			      const uint8_t *record, const char *key) {
+	const struct novena_tlv_record *hdr = (const void *)record;
+	size_t key_length = strlen(key);
+
+	return entry->length >= sizeof(*hdr)
+	    && entry->crc == crc32(0, record, entry->length)
+	    && sizeof(*hdr) + hdr->key_length + hdr->value_length
+			== entry->length
+	    && hdr->key_length == key_length
+	    && !memcmp(record + sizeof(*hdr), key, key_length);
+}
+
+/*
+ * End of the space available to records: the start of the eepromoops
+ * area if there is one, otherwise the end of the chip.
+ */
+static int tlv_area_limit(struct eeprom_dev *dev, uint32_t *limit) {
+	struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
+
+	if (eeprom_read(dev))
+		return 1;
+
+	if (memcmp(v2->signature, NOVENA_SIGNATURE, sizeof(v2->signature))
+	 || v2->version < 2)
+		return eeprom_error(&dev->error, eeprom_err_not_found,
+				    "No v2 or later header on the EEPROM, so "
+				    "there's no record area");
+
+	*limit = v2->eeprom_size ? v2->eeprom_size : DEFAULT_EEPROM_SIZE;
+	if ((v2->features & feature_eepromoops)
+	 && v2->eepromoops_offset >= NOVENA_TLV_RECORDS_OFFSET
+	 && v2->eepromoops_offset < *limit)
+		*limit = v2->eepromoops_offset;
+
+	/* Record offsets are 16 bits */
+	if (*limit > 0xffff)
+		*limit = 0xffff;
+
+	if (*limit <= NOVENA_TLV_RECORDS_OFFSET)
+		return eeprom_error(&dev->error, eeprom_err_no_space,
+				    "No room for a record area before 0x%04x",
+				    *limit);
+	return 0;
+}
+
+int eeprom_tlv_get(struct eeprom_dev *dev, const char *key, void *value,
+		   uint32_t *len) {
+	struct novena_tlv_index index;
+	uint32_t key_crc = crc32(0, key, strlen(key));
+	int ret;
+	int i;
+
+	ret = tlv_read_index(dev, &index);
+	if (ret < 0)
+		return 1;
+	if (ret)
+		return eeprom_error(&dev->error, eeprom_err_not_found,
+				    "No valid record index on the EEPROM");
+
+	for (i = 0; i < index.count; i++) {
+		const struct novena_tlv_entry *entry = &index.entries[i];
+		const struct novena_tlv_record *hdr;
+		uint8_t *record;
+
+		if (entry->key_crc != key_crc)
+			continue;
+
+		record = malloc(entry->length);
+		if (!record)
+			return eeprom_error(&dev->error, eeprom_err_nomem,
+					    "Unable to alloc data");
+
+		if (eeprom_read_at(dev, entry->offset, record, entry->length)) {
+			free(record);
+			return 1;
+		}
+
+		/* A CRC collision, or a damaged record */
+		if (!tlv_record_matches(entry, record, key)) {
+			free(record);
+			continue;
+		}
+
+		hdr = (const void *)record;
+		memcpy(value, record + sizeof(*hdr) + hdr->key_length,
+		       hdr->value_length < *len ? hdr->value_length : *len);
+		*len = hdr->value_length;
+		free(record);
+		return 0;
+	}
+
+	return eeprom_error(&dev->error, eeprom_err_not_found,
+			    "No \"%s\" record on the EEPROM", key);
+}
+
+/*
+ * Rebuild the record area with key replaced (or removed, if len is 0),
+ * packing the remaining records together.  Only pages that actually
+ * change get written.
+ */
+int eeprom_tlv_set(struct eeprom_dev *dev, const char *key,
+		   const void *value, uint32_t len) {
+	struct novena_tlv_index old_index;
+	struct novena_tlv_index *index;
+	struct novena_tlv_record hdr;
+	uint32_t key_length = strlen(key);
+	uint32_t key_crc = crc32(0, key, key_length);
+	uint32_t limit = 0, old_end, new_end, size;
+	uint8_t *old = NULL, *new = NULL;
+	uint8_t *records;
+	int ret = 1;
+	int i;
+
+	if (key_length == 0 || key_length > 255 || len > 0xffff)
+		return eeprom_error(&dev->error, eeprom_err_invalid,
+				    "Record key must be 1-255 bytes and value "
+				    "at most 65535 bytes");
+
+	if (tlv_area_limit(dev, &limit))
+		return 1;
+
+	ret = tlv_read_index(dev, &old_index);
+	if (ret < 0)
+		return 1;
+	size = limit - NOVENA_TLV_INDEX_OFFSET;
+	old = malloc(size);
+	new = malloc(size);
+	if (!old || !new) {
+		ret = eeprom_error(&dev->error, eeprom_err_nomem,
+				   "Unable to alloc data");
+		goto out;
+	}
+
+	/* What's on the chip now, so unchanged pages can be skipped */
+	memcpy(old, &old_index, sizeof(old_index));
+
+	old_end = (ret || old_index.area_end > limit)
+			? NOVENA_TLV_RECORDS_OFFSET : old_index.area_end;
+	if (ret)
+		old_index.count = 0;
+	ret = 1;
+
+	records = old + sizeof(old_index);
+	if (old_end > NOVENA_TLV_RECORDS_OFFSET
+	 && eeprom_read_at(dev, NOVENA_TLV_RECORDS_OFFSET, records,
+			   old_end - NOVENA_TLV_RECORDS_OFFSET))
+		goto out;
+
+	index = (struct novena_tlv_index *)new;
+	memset(index, 0, sizeof(*index));
+	memcpy(index->magic, NOVENA_TLV_MAGIC, sizeof(index->magic));
+	new_end = NOVENA_TLV_RECORDS_OFFSET;
+
+	for (i = 0; i < old_index.count; i++) {
+		struct novena_tlv_entry *entry = &old_index.entries[i];
+		uint8_t *record = old + entry->offset - NOVENA_TLV_INDEX_OFFSET;
+
+		if (entry->offset < NOVENA_TLV_RECORDS_OFFSET
+		 || entry->offset + entry->length > old_end)
+			continue;
+
+		/* Drop the record being replaced, and any damaged ones */
+		if (entry->crc != crc32(0, record, entry->length))
+			continue;
+		if (entry->key_crc == key_crc
+		 && tlv_record_matches(entry, record, key))
+			continue;
+
+		memcpy(new + new_end - NOVENA_TLV_INDEX_OFFSET, record,
+		       entry->length);
+		index->entries[index->count] = *entry;
+		index->entries[index->count].offset = new_end;
+		index->count++;
+		new_end += entry->length;
+	}
+
+	if (len) {
+		uint32_t length = sizeof(hdr) + key_length + len;
+
+		if (index->count >= NOVENA_TLV_MAX_RECORDS
+		 || new_end + length > limit) {
+			eeprom_error(&dev->error, eeprom_err_no_space,
+				     "No room for \"%s\" in the record area",
+				     key);
+			goto out;
+		}
+
+		hdr.key_length = key_length;
+		hdr.reserved = 0;
+		hdr.value_length = len;
+		records = new + new_end - NOVENA_TLV_INDEX_OFFSET;
+		memcpy(records, &hdr, sizeof(hdr));
+		memcpy(records + sizeof(hdr), key, key_length);
+		memcpy(records + sizeof(hdr) + key_length, value, len);
+
+		index->entries[index->count].key_crc = key_crc;
+		index->entries[index->count].offset = new_end;
+		index->entries[index->count].length = length;
+		index->entries[index->count].crc = crc32(0, records, length);
+		index->count++;
+		new_end += length;
+	}
+
+	index->area_end = new_end;
+	index->crc = crc32(0, index, offsetof(struct novena_tlv_index, crc));
+
+	/* Records may now reach past what was read back */
+	if (new_end > old_end
+	 && eeprom_read_at(dev, old_end,
+			   old + old_end - NOVENA_TLV_INDEX_OFFSET,
+			   new_end - old_end))
+		goto out;
+
+	ret = eeprom_write_at(dev, NOVENA_TLV_INDEX_OFFSET, new, old,
+			      new_end - NOVENA_TLV_INDEX_OFFSET);
+
+out:
+	free(old);
+	free(new);
+	return ret;
+}
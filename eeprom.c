@@ -0,0 +1,1203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stddef.h>
+
+#include "eeprom.h"
+#include "crc32.h"
+
+/*
+ * Parts of each slot re-read from the chip to check that a cached image
+ * is still current.  The identifying fields of slot A are all that a
+ * pre-v3 chip has to go on; the sequence number and CRC of each slot
+ * change on every v3 write.
+ */
+static const struct cache_probe {
+	int				slot;
+	uint32_t			offset;
+	uint32_t			size;
+} cache_probes[] = {
+	{
+		.slot	= 0,
+		.offset	= 0,
+		.size	= offsetof(struct novena_eeprom_data_v2, lvds1),
+	},
+	{
+		.slot	= 0,
+		.offset	= offsetof(struct novena_eeprom_data_v3, sequence),
+		.size	= sizeof(struct novena_eeprom_data_v3)
+			- offsetof(struct novena_eeprom_data_v3, sequence),
+	},
+	{
+		.slot	= 1,
+		.offset	= offsetof(struct novena_eeprom_data_v3, sequence),
+		.size	= sizeof(struct novena_eeprom_data_v3)
+			- offsetof(struct novena_eeprom_data_v3, sequence),
+	},
+};
+
+static uint32_t slot_offset(int slot) {
+	return slot ? NOVENA_SLOT_B_OFFSET : 0;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Wait for the EEPROM to finish its internal write cycle.  With ACK
+ * polling, this returns as soon as the real tWR has elapsed, rather
+ * than always waiting for the worst case.
+ */
+static int eeprom_wait_write(struct eeprom_dev *dev) {
+	struct eeprom_backend *be = dev->be;
+	uint64_t start;
+	int ret = 0;
+
+	/* The backend has already waited for the write to complete */
+	if (!be->ops->ready)
+		return 0;
+
+	start = now_ns();
+	if (!dev->ack_poll_ms)
+		usleep(WRITE_CYCLE_US);
+	else {
+		while (be->ops->ready(be)) {
+			if (now_ns() - start > dev->ack_poll_ms * 1000000ULL) {
+				ret = eeprom_error(&dev->error,
+						   eeprom_err_timeout,
+						   "EEPROM did not finish "
+						   "writing within %d ms",
+						   dev->ack_poll_ms);
+				break;
+			}
+		}
+	}
+	dev->stats.waits++;
+	dev->stats.wait_ns += now_ns() - start;
+
+	return ret;
+}
+
+static int eeprom_read_raw(struct eeprom_dev *dev, uint32_t offset,
+			   void *data, uint32_t count) {
+	uint64_t start = now_ns();
+	int ret;
+
+	ret = dev->be->ops->read(dev->be, offset, data, count);
+
+	dev->stats.xfer_ns += now_ns() - start;
+	dev->stats.reads++;
+	if (!ret)
+		dev->stats.bytes_read += count;
+	return ret;
+}
+
+static int eeprom_write_raw(struct eeprom_dev *dev, uint32_t offset,
+			    const void *data, uint32_t count) {
+	uint64_t start = now_ns();
+	int ret;
+
+	ret = dev->be->ops->write(dev->be, offset, data, count);
+
+	dev->stats.xfer_ns += now_ns() - start;
+	dev->stats.writes++;
+	if (!ret)
+		dev->stats.bytes_written += count;
+	return ret;
+}
+
+/*
+ * Use the newest valid slot.  A chip that has never had a v3 header
+ * written has its header, if any, in slot A.
+ */
+static void eeprom_pick_slot(struct eeprom_dev *dev) {
+	int slot;
+
+	slot = novena_eeprom_pick_slot(&dev->shadow[0], &dev->shadow[1],
+				       sizeof(dev->shadow[0]));
+	dev->active_slot = slot < 0 ? 0 : slot;
+}
+
+/* Fetch both header slots into dev->shadow, with a single read */
+static int eeprom_read_slots(struct eeprom_dev *dev) {
+	uint8_t buffer[NOVENA_SLOT_B_OFFSET + sizeof(dev->shadow[1])];
+
+	if (eeprom_read_raw(dev, 0, buffer, sizeof(buffer)))
+		return 1;
+
+	memcpy(&dev->shadow[0], buffer, sizeof(dev->shadow[0]));
+	memcpy(&dev->shadow[1], buffer + NOVENA_SLOT_B_OFFSET,
+	       sizeof(dev->shadow[1]));
+	dev->shadow_valid = 1;
+	eeprom_pick_slot(dev);
+	return 0;
+}
+
+/* Check the slots loaded from the cache against the chip */
+static int eeprom_cache_probe(struct eeprom_dev *dev) {
+	uint8_t probe[sizeof(union novena_eeprom_data)];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cache_probes) / sizeof(*cache_probes); i++) {
+		const struct cache_probe *p = &cache_probes[i];
+		const uint8_t *cached = (const uint8_t *)&dev->shadow[p->slot];
+
+		if (eeprom_read_raw(dev, slot_offset(p->slot) + p->offset,
+				    probe, p->size)
+		 || memcmp(probe, cached + p->offset, p->size))
+			return 1;
+	}
+	return 0;
+}
+
+int eeprom_read(struct eeprom_dev *dev) {
+	if (dev->cached)
+		return 0;
+
+	/*
+	 * A persistent cache hit saves reading the whole image.  Re-read
+	 * just a few bytes of it to make sure it's still current.
+	 */
+	if (dev->cache_path && !eeprom_cache_load(dev, dev->shadow)
+	 && !eeprom_cache_probe(dev)) {
+		dev->shadow_valid = 1;
+		eeprom_pick_slot(dev);
+	}
+	else {
+		if (eeprom_read_slots(dev))
+			return 1;
+		eeprom_cache_store(dev);
+	}
+
+	memcpy(&dev->data, &dev->shadow[dev->active_slot], sizeof(dev->data));
+	dev->cached = 1;
+	return 0;
+}
+
+#define V3_FIELD(_name, _member, _min_version) \
+	{ \
+		.name		= _name, \
+		.offset		= offsetof(struct novena_eeprom_data_v3, _member), \
+		.size		= sizeof(((struct novena_eeprom_data_v3 *)0)->_member), \
+		.min_version	= _min_version, \
+	}
+
+const struct eeprom_field eeprom_fields[] = {
+	V3_FIELD("signature",	signature,		1),
+	V3_FIELD("version",	version,		1),
+	V3_FIELD("page_size",	page_size,		2),
+	V3_FIELD("serial",	serial,			1),
+	V3_FIELD("mac",		mac,			1),
+	V3_FIELD("features",	features,		1),
+	V3_FIELD("lvds1",	lvds1,			2),
+	V3_FIELD("lvds2",	lvds2,			2),
+	V3_FIELD("hdmi",	hdmi,			2),
+	V3_FIELD("eeprom_size",	eeprom_size,		2),
+	V3_FIELD("oops_offset",	eepromoops_offset,	2),
+	V3_FIELD("oops_length",	eepromoops_length,	2),
+	V3_FIELD("sequence",	sequence,		3),
+	V3_FIELD("header_length", header_length,	3),
+	V3_FIELD("header_crc",	header_crc,		3),
+	{} /* Sentinel */
+};
+
+/*
+ * Gaps no bigger than this between wanted fields are read through, as
+ * that's cheaper than the address-set message needed to skip them.
+ */
+#define FIELD_MERGE_GAP 4
+
+/*
+ * Guess which slot is in use from just the sequence numbers and
+ * lengths, as checking the CRC would mean reading both slots whole.
+ */
+static int eeprom_guess_slot(struct eeprom_dev *dev) {
+	uint32_t trailer[EEPROM_SLOTS][2];	/* sequence, header_length */
+	int valid[EEPROM_SLOTS];
+	int slot;
+
+	for (slot = 0; slot < EEPROM_SLOTS; slot++) {
+		if (eeprom_read_raw(dev, slot_offset(slot)
+				+ offsetof(struct novena_eeprom_data_v3, sequence),
+				trailer[slot], sizeof(trailer[slot])))
+			return -1;
+		valid[slot] = trailer[slot][1]
+				== sizeof(struct novena_eeprom_data_v3);
+	}
+
+	if (valid[0] && valid[1])
+		return (int32_t)(trailer[1][0] - trailer[0][0]) > 0;
+	return valid[1] && !valid[0];
+}
+
+/*
+ * Read only the fields in mask (bits indexing eeprom_fields[]) into
+ * dev->data, merging neighbouring fields into as few reads as possible.
+ * The version is always fetched, so callers can tell which fields are
+ * meaningful.  The rest of dev->data is left alone.
+ */
+int eeprom_read_fields(struct eeprom_dev *dev, uint32_t mask) {
+	uint8_t *data = (uint8_t *)&dev->data;
+	uint32_t start = 0, end = 0;
+	uint32_t base;
+	int have_range = 0;
+	int slot;
+	int i;
+
+	if (dev->cached)
+		return 0;
+
+	/* A full read from the cache costs less than any partial read */
+	if (dev->cache_path)
+		return eeprom_read(dev);
+
+	slot = eeprom_guess_slot(dev);
+	if (slot < 0)
+		return 1;
+	dev->active_slot = slot;
+	base = slot_offset(slot);
+
+	for (i = 0; eeprom_fields[i].name; i++) {
+		const struct eeprom_field *field = &eeprom_fields[i];
+
+		if (!(mask & (1 << i)) && strcmp(field->name, "version"))
+			continue;
+
+		if (have_range && field->offset <= end + FIELD_MERGE_GAP) {
+			if (field->offset + field->size > end)
+				end = field->offset + field->size;
+			continue;
+		}
+
+		if (have_range
+		 && eeprom_read_raw(dev, base + start, data + start,
+				    end - start))
+			return 1;
+
+		start = field->offset;
+		end = field->offset + field->size;
+		have_range = 1;
+	}
+
+	if (have_range
+	 && eeprom_read_raw(dev, base + start, data + start, end - start))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Make sure dev->shadow reflects the chip.  If the data came from
+ * somewhere other than the chip (e.g. an import), the chip contents
+ * are unknown, so fetch them now.  A single read is far cheaper than
+ * a single page write cycle.
+ */
+static int eeprom_read_shadow(struct eeprom_dev *dev) {
+	if (dev->shadow_valid)
+		return 0;
+
+	return eeprom_read_slots(dev);
+}
+
+/* A page written by eeprom_write_range(), for verification afterwards */
+struct written_page {
+	uint32_t			offset;
+	uint32_t			len;
+	uint32_t			crc;
+};
+
+/*
+ * Read back the pages just written and check each against the CRC of
+ * what was sent.  Runs of consecutive pages are read back together,
+ * so this costs a handful of reads rather than a second write pass.
+ */
+static int eeprom_verify_pages(struct eeprom_dev *dev, int page_size,
+			       const struct written_page *pages, int npages,
+			       uint32_t count) {
+	const struct written_page *first = NULL;
+	uint32_t first_crc = 0;
+	uint8_t *buffer;
+	int failed = 0;
+	int i = 0;
+
+	buffer = malloc(count);
+	if (!buffer)
+		return eeprom_error(&dev->error, eeprom_err_nomem,
+				    "Unable to alloc data");
+
+	while (i < npages) {
+		uint32_t start = pages[i].offset;
+		uint32_t end = start + pages[i].len;
+		int last = i;
+
+		while (last + 1 < npages && pages[last + 1].offset == end) {
+			last++;
+			end += pages[last].len;
+		}
+
+		if (eeprom_read_raw(dev, start, buffer, end - start)) {
+			free(buffer);
+			return 1;
+		}
+
+		for (; i <= last; i++) {
+			uint32_t crc = crc32(0, buffer + pages[i].offset - start,
+					     pages[i].len);
+
+			if (crc == pages[i].crc)
+				continue;
+
+			if (!first) {
+				first = &pages[i];
+				first_crc = crc;
+			}
+			dev->pages_failed++;
+			failed++;
+		}
+	}
+
+	free(buffer);
+	if (!failed)
+		return 0;
+
+	return eeprom_error(&dev->error, eeprom_err_verify,
+			    "Verify failed on %d page%s, first page %u "
+			    "(offset 0x%04x, %u bytes): read back CRC 0x%08x, "
+			    "expected 0x%08x", failed, failed == 1 ? "" : "s",
+			    first->offset / page_size, first->offset,
+			    first->len, first_crc, first->crc);
+}
+
+/*
+ * Write count bytes to the EEPROM at offset, one page at a time.  Page
+ * boundaries are aligned to the chip's address space, so a write that
+ * starts mid-page never wraps around.  If old is non-NULL it holds the
+ * current chip contents of the same range; pages that already match it
+ * are skipped, and it is updated as pages are written.  Backends that
+ * page writes themselves get each run of changed pages in one call.  If
+ * dev->verify is set, the written pages are read back and checked
+ * afterwards.
+ */
+static int eeprom_write_range(struct eeprom_dev *dev, int page_size,
+			      unsigned int offset, const void *data,
+			      void *old, unsigned int count) {
+	const char *buffer = data;
+	char *shadow = old;
+	unsigned int buffer_offset = 0;
+	unsigned int max_chunk = page_size;
+	struct written_page *pages = NULL;
+	int npages = 0;
+	int ret = 0;
+
+	if (page_size <= 0)
+		return eeprom_error(&dev->error, eeprom_err_invalid,
+				    "Invalid EEPROM page size %d", page_size);
+
+	/* The adapter may not manage a whole page at once */
+	if (dev->be->max_write && dev->be->max_write < max_chunk)
+		max_chunk = dev->be->max_write;
+
+	if (dev->verify) {
+		pages = malloc((count / page_size + 2)
+			       * ((page_size + max_chunk - 1) / max_chunk)
+			       * sizeof(*pages));
+		if (!pages)
+			return eeprom_error(&dev->error, eeprom_err_nomem,
+					    "Unable to alloc data");
+	}
+
+	while (buffer_offset < count) {
+		unsigned int chunk;
+		unsigned int done;
+		unsigned int len;
+		int run = 1;
+
+		chunk = page_size - ((offset + buffer_offset) % page_size);
+		if ((buffer_offset + chunk) > count)
+			chunk = count - buffer_offset;
+		if (chunk > max_chunk)
+			chunk = max_chunk;
+
+		/* Pages that already match the chip need not be rewritten */
+		if (shadow &&
+		    !memcmp(shadow + buffer_offset, buffer + buffer_offset,
+			    chunk)) {
+			dev->pages_skipped++;
+			buffer_offset += chunk;
+			continue;
+		}
+
+		/* Pass a run of changed pages down in one go if we can */
+		while (dev->be->spans_pages && buffer_offset + chunk < count) {
+			unsigned int next = count - buffer_offset - chunk;
+
+			if (next > (unsigned int)page_size)
+				next = page_size;
+			if (shadow &&
+			    !memcmp(shadow + buffer_offset + chunk,
+				    buffer + buffer_offset + chunk, next))
+				break;
+			chunk += next;
+			run++;
+		}
+
+		ret = eeprom_write_raw(dev, offset + buffer_offset,
+				       buffer + buffer_offset, chunk);
+		if (ret)
+			goto out;
+
+		ret = eeprom_wait_write(dev);
+		if (ret)
+			goto out;
+
+		/* One entry per page of a run, so a failure names its page */
+		for (done = 0; pages && done < chunk; done += len) {
+			len = page_size - (offset + buffer_offset + done)
+					  % page_size;
+			if (len > chunk - done)
+				len = chunk - done;
+			pages[npages].offset = offset + buffer_offset + done;
+			pages[npages].len = len;
+			pages[npages].crc = crc32(0,
+						  buffer + buffer_offset + done,
+						  len);
+			npages++;
+		}
+
+		if (shadow)
+			memcpy(shadow + buffer_offset, buffer + buffer_offset,
+			       chunk);
+		dev->pages_written += run;
+		buffer_offset += chunk;
+	}
+
+	if (npages)
+		ret = eeprom_verify_pages(dev, page_size, pages, npages, count);
+
+out:
+	free(pages);
+	return ret;
+}
+
+/*
+ * Stamp the sequence number, length and CRC into a v3 header, just
+ * before it's written.  The sequence follows on from the slot being
+ * superseded, if that holds a valid header.
+ */
+static void eeprom_seal(struct eeprom_dev *dev) {
+	struct novena_eeprom_data_v3 *v3 = &dev->data.v3;
+	union novena_eeprom_data *active = &dev->shadow[dev->active_slot];
+
+	if (dev->shadow_valid && !novena_eeprom_check(active, sizeof(*active)))
+		v3->sequence = active->v3.sequence + 1;
+	else
+		v3->sequence++;
+
+	v3->header_length = sizeof(*v3);
+	v3->header_crc = crc32(0, v3, offsetof(struct novena_eeprom_data_v3,
+					       header_crc));
+}
+
+static int eeprom_write_slot(struct eeprom_dev *dev, int slot) {
+	int ret;
+
+	if (dev->data.v3.version == 3)
+		eeprom_seal(dev);
+
+	ret = eeprom_write_range(dev, dev->data.v2.page_size,
+				 slot_offset(slot), &dev->data,
+				 dev->shadow_valid ? &dev->shadow[slot] : NULL,
+				 sizeof(dev->data));
+
+	/* After a failure, the chip contents are no longer known */
+	if (ret)
+		dev->shadow_valid = 0;
+	else
+		dev->active_slot = slot;
+	return ret;
+}
+
+int eeprom_write(struct eeprom_dev *dev) {
+	int ret;
+
+	/*
+	 * If the chip can't be read, fall back to rewriting every page.
+	 * The failure is left in dev->error, in case the write fails too.
+	 */
+	eeprom_read_shadow(dev);
+
+	dev->pages_written = 0;
+	dev->pages_skipped = 0;
+	dev->pages_failed = 0;
+	dev->cached = 1;
+
+	/*
+	 * A v3 header goes to the slot not in use, so the one in use
+	 * survives until the new one is complete.  Boot code that predates
+	 * v3 reads only slot A, so if that left slot B the newer, slot A is
+	 * then brought up to date too.  Slot A always ends up the newer of
+	 * the two, and at every point one slot holds a complete header.
+	 */
+	if (dev->data.v3.version != 3)
+		ret = eeprom_write_slot(dev, 0);
+	else {
+		ret = eeprom_write_slot(dev, !dev->active_slot);
+		if (!ret && dev->active_slot != 0)
+			ret = eeprom_write_slot(dev, 0);
+	}
+
+	/* The shadow tracks every page that made it, so keep the cache too */
+	if (ret || !dev->shadow_valid || eeprom_cache_store(dev))
+		eeprom_cache_invalidate(dev);
+	return ret;
+}
+
+/*
+ * Work out the geometry for whole-chip operations.  Explicit overrides
+ * win, then whatever the v2 header on the chip claims, then defaults.
+ */
+static int eeprom_geometry(struct eeprom_dev *dev, uint32_t *size,
+			   int *page_size) {
+	int have_header;
+
+	if (eeprom_read(dev))
+		return 1;
+
+	if (dev->data.v2.version >= 3)
+		have_header = !novena_eeprom_check(&dev->data,
+						   sizeof(dev->data));
+	else
+		have_header = !memcmp(dev->data.v2.signature, NOVENA_SIGNATURE,
+				      sizeof(dev->data.v2.signature))
+			   && dev->data.v2.version == 2;
+
+	if (!*size)
+		*size = have_header ? dev->data.v2.eeprom_size
+				    : DEFAULT_EEPROM_SIZE;
+	if (!*page_size)
+		*page_size = (have_header && dev->data.v2.page_size)
+				? dev->data.v2.page_size
+				: DEFAULT_PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Erase a range, a chunk at a time.  Each chunk is read in one go, and
+ * only the pages in it that aren't already all 0xff are written, so a
+ * mostly empty range costs little more than reading it.
+ */
+int eeprom_erase(struct eeprom_dev *dev, uint32_t offset, uint32_t count,
+		 eeprom_progress_fn progress, void *arg) {
+	char erased[STREAM_CHUNK];
+	char current[STREAM_CHUNK];
+	uint32_t size = 0;
+	uint32_t done;
+	int page_size = 0;
+	int ret = 1;
+
+	if (eeprom_geometry(dev, &size, &page_size))
+		return 1;
+
+	if (!count && offset < size)
+		count = size - offset;
+	if (offset >= size || count > size - offset)
+		return eeprom_error(&dev->error, eeprom_err_range,
+				    "Erase of %u bytes at 0x%04x runs past the "
+				    "end of the %u-byte EEPROM",
+				    count, offset, size);
+
+	memset(erased, 0xff, sizeof(erased));
+	dev->pages_written = 0;
+	dev->pages_skipped = 0;
+	dev->pages_failed = 0;
+
+	for (done = 0; done < count; ) {
+		uint32_t chunk = sizeof(erased);
+
+		/* Keep chunks page-aligned, so no page is split across two */
+		chunk -= (offset + done) % page_size;
+		if (chunk > count - done)
+			chunk = count - done;
+
+		if (eeprom_read_raw(dev, offset + done, current, chunk))
+			goto out;
+
+		if (eeprom_write_range(dev, page_size, offset + done, erased,
+				       current, chunk))
+			goto out;
+
+		done += chunk;
+		if (progress)
+			progress(arg, done, count);
+	}
+
+	ret = 0;
+
+out:
+	/* The header may have gone */
+	if (offset < NOVENA_TLV_INDEX_OFFSET) {
+		dev->cached = 0;
+		dev->shadow_valid = 0;
+		eeprom_cache_invalidate(dev);
+	}
+	return ret;
+}
+
+int eeprom_read_at(struct eeprom_dev *dev, uint32_t offset, void *data,
+		   uint32_t count) {
+	return eeprom_read_raw(dev, offset, data, count);
+}
+
+int eeprom_write_at(struct eeprom_dev *dev, uint32_t offset,
+		    const void *data, void *old, uint32_t count) {
+	uint32_t size = 0;
+	int page_size = 0;
+
+	if (eeprom_geometry(dev, &size, &page_size))
+		return 1;
+
+	if (offset + count > size)
+		return eeprom_error(&dev->error, eeprom_err_range,
+				    "Write of %u bytes at 0x%04x runs past the "
+				    "end of the %u-byte EEPROM",
+				    count, offset, size);
+
+	dev->pages_written = 0;
+	dev->pages_skipped = 0;
+	dev->pages_failed = 0;
+
+	return eeprom_write_range(dev, page_size, offset, data, old, count);
+}
+
+/*
+ * Write a pattern in one go across the whole scratch block.  A chip with
+ * smaller pages wraps each write within its page, so the first byte of
+ * the block ends up holding the first byte of the last pass around the
+ * page, which gives the page size.  The capacity comes from address
+ * wrap: the smallest size at which the block shows up again.  The block
+ * is put back as it was afterwards, using the page size just found.
+ */
+/*
+ * Set *clash to the size of chip on which the probe's block at scratch
+ * would land on something in use, or to 0 if there is none.  In use
+ * means the header slots, the record index and the records after it,
+ * or the eepromoops area.  The chip may be smaller than the offsets
+ * suggest, so every size the probe can find is tried.  A damaged record
+ * index is still believed, erring towards refusing.
+ */
+static int probe_scratch_in_use(struct eeprom_dev *dev, uint32_t scratch,
+				uint32_t *clash) {
+	struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
+	struct novena_tlv_index index;
+	uint32_t used_end = NOVENA_TLV_RECORDS_OFFSET;
+	uint32_t oops_start = 0;
+	uint32_t oops_end = 0;
+	uint32_t size;
+
+	if (eeprom_read(dev)
+	 || eeprom_read_raw(dev, NOVENA_TLV_INDEX_OFFSET, &index,
+			    sizeof(index)))
+		return 1;
+
+	if (!memcmp(index.magic, NOVENA_TLV_MAGIC, sizeof(index.magic))
+	 && index.area_end > used_end)
+		used_end = index.area_end;
+
+	if (!memcmp(v2->signature, NOVENA_SIGNATURE, sizeof(v2->signature))
+	 && v2->version >= 2 && (v2->features & feature_eepromoops)) {
+		oops_start = v2->eepromoops_offset;
+		oops_end = oops_start + v2->eepromoops_length;
+	}
+
+	*clash = 0;
+	for (size = EEPROM_PROBE_MIN_SIZE; size <= 0x10000; size *= 2) {
+		uint32_t at = scratch % size;
+
+		if (at < used_end
+		 || (at < oops_end && at + EEPROM_PROBE_BLOCK > oops_start)) {
+			*clash = size;
+			break;
+		}
+	}
+	return 0;
+}
+
+int eeprom_probe_geometry(struct eeprom_dev *dev, uint32_t scratch,
+			  uint32_t *size, int *page_size) {
+	uint8_t saved[EEPROM_PROBE_BLOCK];
+	uint8_t pattern[EEPROM_PROBE_BLOCK];
+	uint8_t readback[EEPROM_PROBE_BLOCK];
+	uint8_t alias[EEPROM_PROBE_BLOCK];
+	uint8_t nonce = now_ns() / 1000;
+	uint32_t page;
+	uint32_t i;
+	uint32_t clash;
+	int ret = 1;
+
+	if (scratch % EEPROM_PROBE_BLOCK
+	 || scratch + EEPROM_PROBE_BLOCK > 0x10000)
+		return eeprom_error(&dev->error, eeprom_err_invalid,
+				    "Probe scratch area must be a %d-byte "
+				    "aligned block, not 0x%04x",
+				    EEPROM_PROBE_BLOCK, scratch);
+
+	if (dev->be->max_write && dev->be->max_write < EEPROM_PROBE_BLOCK)
+		return eeprom_error(&dev->error, eeprom_err_unsupported,
+				    "The %s backend can't write %d bytes at "
+				    "once, so page size can't be probed",
+				    dev->be->name, EEPROM_PROBE_BLOCK);
+
+	/* Something below us splits the write, so it never wraps */
+	if (dev->be->spans_pages)
+		return eeprom_error(&dev->error, eeprom_err_unsupported,
+				    "The %s backend pages writes itself, so "
+				    "page size can't be probed",
+				    dev->be->name);
+
+	if (probe_scratch_in_use(dev, scratch, &clash))
+		return 1;
+	if (clash)
+		return eeprom_error(&dev->error, eeprom_err_invalid,
+				    "Probe scratch block 0x%04x would overlap "
+				    "the header, the records or the "
+				    "eepromoops area on a %u-byte chip",
+				    scratch, clash);
+
+	if (eeprom_read_raw(dev, scratch, saved, sizeof(saved)))
+		return 1;
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i + nonce;
+
+	/* Assume the worst for putting things back until we know better */
+	page = 1;
+	if (eeprom_write_raw(dev, scratch, pattern, sizeof(pattern))
+	 || eeprom_wait_write(dev)
+	 || eeprom_read_raw(dev, scratch, readback, sizeof(readback)))
+		goto restore;
+
+	page = (uint8_t)(pattern[sizeof(pattern) - 1] - readback[0] + 1);
+	if (!page)
+		page = EEPROM_PROBE_BLOCK;
+
+	/* The last pass around the page, then what was there before */
+	for (i = 0; i < sizeof(readback); i++) {
+		uint8_t expect = i < page
+				? pattern[sizeof(pattern) - page + i]
+				: saved[i];
+
+		if (EEPROM_PROBE_BLOCK % page || readback[i] != expect) {
+			eeprom_error(&dev->error, eeprom_err_format,
+				     "Probe pattern read back as nothing a "
+				     "page wrap would leave, at 0x%04x",
+				     scratch + i);
+			page = 1;
+			goto restore;
+		}
+	}
+
+	/* No wrap within the block: pages are at least as big as it */
+	*page_size = page < EEPROM_PROBE_BLOCK ? (int)page : 0;
+	*size = 0x10000;
+	for (i = EEPROM_PROBE_MIN_SIZE; i < 0x10000; i *= 2) {
+		if (eeprom_read_raw(dev, (scratch + i) & 0xffff, alias,
+				    sizeof(alias)))
+			goto restore;
+		if (!memcmp(alias, readback, sizeof(alias))) {
+			*size = i;
+			break;
+		}
+	}
+	ret = 0;
+
+restore:
+	dev->pages_written = 0;
+	dev->pages_skipped = 0;
+	dev->pages_failed = 0;
+	if (page == 1
+	 && eeprom_read_raw(dev, scratch, readback, sizeof(readback)))
+		memset(readback, 0, sizeof(readback));
+	if (eeprom_write_range(dev, page, scratch, saved, readback,
+			       sizeof(saved)))
+		return eeprom_error(&dev->error, dev->error.code,
+				    "Unable to restore the %d bytes at 0x%04x "
+				    "after probing", EEPROM_PROBE_BLOCK,
+				    scratch);
+	return ret;
+}
+
+/* Stream the entire chip out to a file, one chunk at a time */
+int eeprom_dump(struct eeprom_dev *dev, const char *filename,
+		       uint32_t size) {
+	char buffer[STREAM_CHUNK];
+	uint32_t offset;
+	int page_size = 0;
+	FILE *f;
+
+	if (eeprom_geometry(dev, &size, &page_size))
+		return 1;
+
+	f = fopen(filename, "w");
+	if (NULL == f) {
+		return eeprom_syserror(&dev->error, eeprom_err_system,
+				       "Unable to open %s for dumping",
+				       filename);
+	}
+
+	for (offset = 0; offset < size; offset += sizeof(buffer)) {
+		uint32_t count = sizeof(buffer);
+
+		if (offset + count > size)
+			count = size - offset;
+
+		if (eeprom_read_raw(dev, offset, buffer, count))
+			goto err;
+
+		if (fwrite(buffer, count, 1, f) != 1) {
+			eeprom_syserror(&dev->error, eeprom_err_system,
+					"Unable to dump");
+			goto err;
+		}
+	}
+
+	if (fclose(f))
+		return eeprom_syserror(&dev->error, eeprom_err_system,
+				       "Unable to dump");
+	return 0;
+
+err:
+	fclose(f);
+	return 1;
+}
+
+/*
+ * Stream a whole-chip image from a file back onto the chip.  Each
+ * chunk is compared against the chip first, so only pages that differ
+ * cost a write cycle.
+ */
+int eeprom_restore(struct eeprom_dev *dev, const char *filename,
+			  uint32_t size, int page_size) {
+	char buffer[STREAM_CHUNK];
+	char current[STREAM_CHUNK];
+	uint32_t offset = 0;
+	size_t count;
+	FILE *f;
+
+	if (eeprom_geometry(dev, &size, &page_size))
+		return 1;
+
+	f = fopen(filename, "r");
+	if (NULL == f) {
+		return eeprom_syserror(&dev->error, eeprom_err_system,
+				       "Unable to open %s for restoring",
+				       filename);
+	}
+
+	dev->pages_written = 0;
+	dev->pages_skipped = 0;
+	dev->pages_failed = 0;
+
+	while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		if (offset + count > size) {
+			eeprom_error(&dev->error, eeprom_err_range,
+				     "Image is larger than the %u-byte EEPROM",
+				     size);
+			goto err;
+		}
+
+		if (eeprom_read_raw(dev, offset, current, count))
+			goto err;
+
+		if (eeprom_write_range(dev, page_size, offset, buffer,
+				       current, count))
+			goto err;
+
+		offset += count;
+	}
+
+	if (ferror(f)) {
+		eeprom_syserror(&dev->error, eeprom_err_system,
+				"Unable to restore");
+		goto err;
+	}
+
+	fclose(f);
+
+	/* The header may have changed underneath us */
+	dev->cached = 0;
+	dev->shadow_valid = 0;
+	eeprom_cache_invalidate(dev);
+	return 0;
+
+err:
+	fclose(f);
+	dev->cached = 0;
+	dev->shadow_valid = 0;
+	eeprom_cache_invalidate(dev);
+	return 1;
+}
+
+int eeprom_export(struct eeprom_dev *dev, const char *filename) {
+	FILE *f;
+	int ret;
+
+	/* Ensure we have a cached copy */
+	if (eeprom_read(dev) != 0)
+		return 1;
+
+	f = fopen(filename, "w");
+	if (NULL == f) {
+		return eeprom_syserror(&dev->error, eeprom_err_system,
+				       "Unable to open %s for exporting",
+				       filename);
+	}
+
+	ret = fwrite(&dev->data, sizeof(dev->data), 1, f);
+	if (ret != 1) {
+		eeprom_syserror(&dev->error, eeprom_err_system,
+				"Unable to export");
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int eeprom_import(struct eeprom_dev *dev, const char *filename) {
+	FILE *f;
+	int ret;
+
+	f = fopen(filename, "r");
+	if (NULL == f) {
+		return eeprom_syserror(&dev->error, eeprom_err_system,
+				       "Unable to open %s for importing",
+				       filename);
+	}
+
+	/* Files exported before v3 hold just the v2 header */
+	memset(&dev->data, 0, sizeof(dev->data));
+	ret = fread(&dev->data, 1, sizeof(dev->data), f);
+	if (ret < (int)sizeof(dev->data.v2)) {
+		eeprom_error(&dev->error, eeprom_err_format,
+			     "Import file %s is too short", filename);
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+
+	/* Mark the copy as cached, so it won't get re-read */
+	dev->cached = 1;
+
+	return 0;
+}
+
+struct eeprom_dev *eeprom_open(const char *path, int addr,
+			       struct eeprom_error *err) {
+	struct eeprom_dev *dev;
+
+	dev = malloc(sizeof(*dev));
+	if (!dev) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto malloc_err;
+	}
+
+	memset(dev, 0, sizeof(*dev));
+
+	dev->path = strdup(path);
+	if (!dev->path) {
+		eeprom_error(err, eeprom_err_nomem, "Unable to alloc data");
+		goto strdup_err;
+	}
+	dev->addr = addr;
+
+	dev->be = eeprom_backend_open(path, addr, &dev->error);
+	if (!dev->be)
+		goto open_err;
+
+	return dev;
+
+open_err:
+	if (err)
+		*err = dev->error;
+	free(dev->path);
+strdup_err:
+	free(dev);
+malloc_err:
+	return NULL;
+}
+
+void eeprom_get_defaults(struct eeprom_dev *dev) {
+	memset(&dev->data, 0, sizeof(dev->data));
+
+	memcpy(dev->data.v2.signature, NOVENA_SIGNATURE, sizeof(dev->data.v2.signature));
+
+	memset(&dev->data.v2.mac, 0xff, sizeof(dev->data.v2.mac));
+
+	dev->data.v3.version = 3;
+	dev->data.v3.header_length = sizeof(dev->data.v3);
+
+	dev->data.v2.features = feature_es8328 | feature_pcie | feature_gbit |
+		     feature_hdmi | feature_retina | feature_eepromoops;
+
+	dev->data.v2.eepromoops_offset = 4096;
+	dev->data.v2.eepromoops_length = 61440;
+
+	dev->data.v2.eeprom_size = DEFAULT_EEPROM_SIZE;
+	dev->data.v2.page_size = DEFAULT_PAGE_SIZE;
+
+	dev->data.v2.lvds1.frequency = 148500000;
+	dev->data.v2.lvds1.hactive = 1920;
+	dev->data.v2.lvds1.vactive = 1080;
+	dev->data.v2.lvds1.hback_porch = 148;
+	dev->data.v2.lvds1.hfront_porch = 88;
+	dev->data.v2.lvds1.hsync_len = 44;
+	dev->data.v2.lvds1.vback_porch = 36;
+	dev->data.v2.lvds1.vfront_porch = 4;
+	dev->data.v2.lvds1.vsync_len = 5;
+	dev->data.v2.lvds1.flags = vsync_polarity | hsync_polarity | data_width_8bit
+		      | mapping_jeida | dual_channel | channel_present;
+
+	dev->data.v2.lvds2.flags = channel_present;
+
+	/* Pull HDMI settings from e.g. EDID */
+	dev->data.v2.hdmi.flags = channel_present | ignore_settings | data_width_8bit;
+}
+
+void eeprom_upgrade_v1_to_v2(struct eeprom_dev *dev) {
+	if (dev->data.v2.version != 1)
+		return;
+
+        dev->data.v2.features |= feature_eepromoops;
+
+        dev->data.v2.eepromoops_offset = 4096;
+        dev->data.v2.eepromoops_length = 61440;
+
+        dev->data.v2.eeprom_size = 65536;
+        dev->data.v2.page_size = 128;
+
+        if (dev->data.v2.features & feature_retina) {
+            dev->data.v2.lvds1.frequency = 148500000;
+            dev->data.v2.lvds1.hactive = 1920;
+            dev->data.v2.lvds1.vactive = 1080;
+            dev->data.v2.lvds1.hback_porch = 148;
+            dev->data.v2.lvds1.hfront_porch = 88;
+            dev->data.v2.lvds1.hsync_len = 44;
+            dev->data.v2.lvds1.vback_porch = 36;
+            dev->data.v2.lvds1.vfront_porch = 4;
+            dev->data.v2.lvds1.vsync_len = 5;
+            dev->data.v2.lvds1.flags = vsync_polarity | hsync_polarity
+				     | data_width_8bit | mapping_jeida
+				     | dual_channel | channel_present;
+
+            dev->data.v2.lvds2.flags = channel_present;
+        }
+
+        if (dev->data.v2.features & feature_hdmi) {
+		/* Pull HDMI settings from e.g. EDID */
+		dev->data.v2.hdmi.flags = channel_present | ignore_settings
+					| data_width_8bit;
+        }
+
+        dev->data.v2.version = 2;
+}
+
+void eeprom_upgrade_v2_to_v3(struct eeprom_dev *dev) {
+	if (dev->data.v2.version != 2)
+		return;
+
+	/* The CRC is filled in when the header is next written */
+	dev->data.v3.version = 3;
+	dev->data.v3.sequence = 0;
+	dev->data.v3.header_length = sizeof(dev->data.v3);
+	dev->data.v3.header_crc = 0;
+}
+
+/*
+ * Read the chip and make sure dev->data holds a v3 image that can be
+ * edited, upgrading old data or falling back to defaults as needed.
+ */
+int eeprom_prepare(struct eeprom_dev *dev, enum eeprom_origin *origin) {
+	if (eeprom_read(dev))
+		return 1;
+
+	if (dev->data.v1.version == 1) {
+		*origin = eeprom_origin_v1;
+		eeprom_upgrade_v1_to_v2(dev);
+		eeprom_upgrade_v2_to_v3(dev);
+	}
+	else if (dev->data.v1.version == 2) {
+		*origin = eeprom_origin_v2;
+		eeprom_upgrade_v2_to_v3(dev);
+	}
+	else if (dev->data.v1.version == 3
+	      && !novena_eeprom_check(&dev->data, sizeof(dev->data))) {
+		*origin = eeprom_origin_v3;
+	}
+	else {
+		if (memcmp(dev->data.v2.signature, NOVENA_SIGNATURE,
+				sizeof(dev->data.v2.signature)))
+			*origin = eeprom_origin_blank;
+		else if (dev->data.v1.version == 3)
+			*origin = eeprom_origin_corrupt;
+		else
+			*origin = eeprom_origin_unknown;
+		eeprom_get_defaults(dev);
+	}
+
+	return 0;
+}
+
+void eeprom_apply_update(struct eeprom_dev *dev,
+			 const struct eeprom_update *update) {
+	const struct novena_eeprom_data_v2 *newrom = &update->data;
+
+	if (update->fields & update_mac)
+		memcpy(&dev->data.v2.mac, newrom->mac, sizeof(newrom->mac));
+	if (update->fields & update_serial)
+		dev->data.v2.serial = newrom->serial;
+	if (update->fields & update_features)
+		dev->data.v2.features = newrom->features;
+	if (update->fields & update_oops_start)
+		dev->data.v2.eepromoops_offset = newrom->eepromoops_offset;
+	if (update->fields & update_oops_length)
+		dev->data.v2.eepromoops_length = newrom->eepromoops_length;
+	if (update->fields & update_page_size)
+		dev->data.v2.page_size = newrom->page_size;
+	if (update->fields & update_total_size)
+		dev->data.v2.eeprom_size = newrom->eeprom_size;
+	if (update->fields & update_lvds1)
+		memcpy(&dev->data.v2.lvds1, &newrom->lvds1,
+			sizeof(dev->data.v2.lvds1));
+	if (update->fields & update_lvds2)
+		memcpy(&dev->data.v2.lvds2, &newrom->lvds2,
+			sizeof(dev->data.v2.lvds2));
+	if (update->fields & update_hdmi)
+		memcpy(&dev->data.v2.hdmi, &newrom->hdmi,
+			sizeof(dev->data.v2.hdmi));
+	memcpy(&dev->data.v2.signature,
+			NOVENA_SIGNATURE,
+			sizeof(dev->data.v2.signature));
+
+	dev->data.v3.version = 3;
+	dev->data.v3.header_length = sizeof(dev->data.v3);
+}
+
+int eeprom_close(struct eeprom_dev **dev) {
+	if (!dev || !*dev)
+		return 0;
+	(*dev)->be->ops->close((*dev)->be);
+	free((*dev)->cache_path);
+	free((*dev)->path);
+	free(*dev);
+	*dev = NULL;
+	return 0;
+}
@@ -0,0 +1,238 @@
+#ifndef __EEPROM_H__
+#define __EEPROM_H__
+
+#include <stdint.h>
+
+#include "novena-eeprom.h"
+#include "eeprom-backend.h"
+
+#pragma GCC visibility push(default)
+
+/* Fixed delay after each page write, long enough for any supported part */
+#define WRITE_CYCLE_US 10000
+
+/* Default time to wait for the EEPROM to ACK again, when ACK polling */
+#define ACK_POLL_TIMEOUT_MS 25
+
+/* Geometry of the part fitted to Novena, used if the header is blank */
+#define DEFAULT_EEPROM_SIZE 65536
+#define DEFAULT_PAGE_SIZE 128
+
+/* Whole-chip dumps and restores move data in chunks of this size */
+#define STREAM_CHUNK 4096
+
+/*
+ * Geometry probing writes a block this big, so page sizes up to it can
+ * be told apart, and looks for it again at sizes from the minimum up
+ */
+#define EEPROM_PROBE_BLOCK 256
+#define EEPROM_PROBE_MIN_SIZE 4096
+
+/* Where time goes when talking to the chip */
+struct eeprom_stats {
+	/* Calls into the backend, and the bytes they moved */
+	unsigned long			reads;
+	unsigned long			writes;
+	unsigned long			bytes_read;
+	unsigned long			bytes_written;
+
+	/* Time spent in backend transfers, in ns */
+	uint64_t			xfer_ns;
+
+	/* Write cycles waited for, and the time spent doing so, in ns */
+	unsigned long			waits;
+	uint64_t			wait_ns;
+};
+
+/* Fields of struct eeprom_update to apply, as a bitmask */
+enum eeprom_update_fields {
+	update_mac		= 0x0001,
+	update_serial		= 0x0002,
+	update_features		= 0x0004,
+	update_oops_start	= 0x0008,
+	update_oops_length	= 0x0010,
+	update_page_size	= 0x0020,
+	update_total_size	= 0x0040,
+	update_lvds1		= 0x0080,
+	update_lvds2		= 0x0100,
+	update_hdmi		= 0x0200,
+};
+
+/* A set of changes to make to an EEPROM image */
+struct eeprom_update {
+	/* enum eeprom_update_fields mask */
+	uint32_t			fields;
+
+	/* New values of the fields selected above */
+	struct novena_eeprom_data_v2	data;
+};
+
+/* What eeprom_prepare() found on the chip */
+enum eeprom_origin {
+	eeprom_origin_v3,		/* Valid v3 data, used as-is */
+	eeprom_origin_v2,		/* v2 data, upgraded to v3 */
+	eeprom_origin_v1,		/* v1 data, upgraded to v3 */
+	eeprom_origin_corrupt,		/* v3 data failing its CRC, defaults used */
+	eeprom_origin_blank,		/* No signature, defaults used */
+	eeprom_origin_unknown,		/* Unknown version, defaults used */
+};
+
+/* A field of the header that can be read on its own */
+struct eeprom_field {
+	const char			*name;
+	uint32_t			offset;
+	uint32_t			size;
+
+	/* Oldest header version the field is meaningful in */
+	int				min_version;
+};
+
+/* Sentinel-terminated, in order of offset */
+extern const struct eeprom_field eeprom_fields[];
+
+/* Number of header slots on the chip, see NOVENA_SLOT_B_OFFSET */
+#define EEPROM_SLOTS 2
+
+union novena_eeprom_data {
+	struct novena_eeprom_data_v1	v1;
+	struct novena_eeprom_data_v2	v2;
+	struct novena_eeprom_data_v3	v3;
+};
+
+struct eeprom_dev {
+	/* Backend used to reach the chip */
+	struct eeprom_backend		*be;
+
+	/* Device path and I2C address the chip was opened with */
+	char				*path;
+	int				addr;
+
+	/* If non-NULL, file the last-read image is cached in */
+	char				*cache_path;
+
+	/* If nonzero, poll for write completion for up to this many ms */
+	int				ack_poll_ms;
+
+	/* If nonzero, read back and check every page that gets written */
+	int				verify;
+
+	/* True, if we've read the contents of eeprom */
+	int				cached;
+
+	/* Contents of the EEPROM */
+	union novena_eeprom_data 	data;
+
+	/* Header slot data came from; the next write goes to the other */
+	int				active_slot;
+
+	/* True, if shadow holds what is currently on the chip */
+	int				shadow_valid;
+
+	/* Each header slot as last read from (or written to) the chip */
+	union novena_eeprom_data 	shadow[EEPROM_SLOTS];
+
+	/* Page statistics from the most recent eeprom_write() */
+	int				pages_written;
+	int				pages_skipped;
+	int				pages_failed;
+
+	/* Payload bytes given to the most recent eeprom_oops_append(),
+	 * and what they took up once compressed */
+	uint32_t			oops_bytes;
+	uint32_t			oops_bytes_stored;
+
+	/* Running totals of all traffic to the chip */
+	struct eeprom_stats		stats;
+
+	/* Why the most recent call that failed did so */
+	struct eeprom_error		error;
+};
+
+/*
+ * Open the chip at addr on path (see eeprom_backend_open()).  On
+ * failure, returns NULL with the reason in err, if non-NULL.  Calls
+ * made on the device after that leave their reasons in dev->error.
+ */
+struct eeprom_dev *eeprom_open(const char *path, int addr,
+			       struct eeprom_error *err);
+int eeprom_close(struct eeprom_dev **dev);
+
+int eeprom_read(struct eeprom_dev *dev);
+int eeprom_write(struct eeprom_dev *dev);
+
+int eeprom_export(struct eeprom_dev *dev, const char *filename);
+int eeprom_import(struct eeprom_dev *dev, const char *filename);
+int eeprom_dump(struct eeprom_dev *dev, const char *filename, uint32_t size);
+int eeprom_restore(struct eeprom_dev *dev, const char *filename,
+		   uint32_t size, int page_size);
+
+/* Called as a long operation makes its way through total bytes */
+typedef void (*eeprom_progress_fn)(void *arg, uint32_t done, uint32_t total);
+
+/*
+ * Set count bytes from offset (to the end of the chip, if count is 0)
+ * to 0xff.  Pages already erased are not written.
+ */
+int eeprom_erase(struct eeprom_dev *dev, uint32_t offset, uint32_t count,
+		 eeprom_progress_fn progress, void *arg);
+
+/*
+ * Find the chip's real page size and capacity by writing to the scratch
+ * block at offset scratch, which is restored afterwards.  *page_size is
+ * set to 0 if pages are EEPROM_PROBE_BLOCK bytes or more, which is too
+ * big to tell (or to record in the header).  Backends that page writes
+ * themselves can't be probed.  The scratch block must not overlap the
+ * header, the records or the eepromoops area, wherever it lands on a
+ * chip of any size from EEPROM_PROBE_MIN_SIZE up.
+ */
+int eeprom_probe_geometry(struct eeprom_dev *dev, uint32_t scratch,
+			  uint32_t *size, int *page_size);
+
+void eeprom_get_defaults(struct eeprom_dev *dev);
+void eeprom_upgrade_v1_to_v2(struct eeprom_dev *dev);
+void eeprom_upgrade_v2_to_v3(struct eeprom_dev *dev);
+
+int eeprom_read_fields(struct eeprom_dev *dev, uint32_t mask);
+
+/*
+ * Raw access to the rest of the chip.  Writes are split into pages as
+ * the header describes, and pages matching old (if non-NULL) are
+ * skipped.
+ */
+int eeprom_read_at(struct eeprom_dev *dev, uint32_t offset, void *data,
+		   uint32_t count);
+int eeprom_write_at(struct eeprom_dev *dev, uint32_t offset,
+		    const void *data, void *old, uint32_t count);
+
+/*
+ * Records in the area after the header.  eeprom_tlv_get() fills in up to
+ * *len bytes of value and sets *len to the record's full length.
+ * Setting a zero-length value removes the record.
+ */
+int eeprom_tlv_get(struct eeprom_dev *dev, const char *key, void *value,
+		   uint32_t *len);
+int eeprom_tlv_set(struct eeprom_dev *dev, const char *key,
+		   const void *value, uint32_t len);
+
+int eeprom_cache_enable(struct eeprom_dev *dev, const char *dir);
+int eeprom_cache_load(struct eeprom_dev *dev, union novena_eeprom_data *slots);
+int eeprom_cache_store(struct eeprom_dev *dev);
+void eeprom_cache_invalidate(struct eeprom_dev *dev);
+
+/*
+ * Parsers for the values the header holds.  These touch nothing but
+ * their arguments, and say what was wrong with the text in err.
+ */
+int eeprom_parse_mac(const char *str, void *out, struct eeprom_error *err);
+int eeprom_parse_features(const char *str, uint16_t *flags,
+			  struct eeprom_error *err);
+int eeprom_parse_modesetting(struct modesetting *m, const char *arg,
+			     struct eeprom_error *err);
+
+int eeprom_prepare(struct eeprom_dev *dev, enum eeprom_origin *origin);
+void eeprom_apply_update(struct eeprom_dev *dev,
+			 const struct eeprom_update *update);
+
+#pragma GCC visibility pop
+
+#endif /* __EEPROM_H__ */
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+
+/* The format requires blocks to end in literals */
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+
+static uint32_t lz_read32(const uint8_t *p) {
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint32_t lz_hash(uint32_t val) {
+	return (val * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the part of a length that doesn't fit in the token */
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *oend, uint32_t len) {
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+/* Emit literals, then a match unless this is the final sequence */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend,
+				const uint8_t *literals, uint32_t nliterals,
+				uint32_t offset, uint32_t match) {
+	uint8_t *token;
+
+	if (op >= oend)
+		return NULL;
+	token = op++;
+
+	*token = (nliterals < 15 ? nliterals : 15) << 4;
+	if (nliterals >= 15 && !(op = lz_put_length(op, oend, nliterals - 15)))
+		return NULL;
+
+	if (nliterals > (uint32_t)(oend - op))
+		return NULL;
+	memcpy(op, literals, nliterals);
+	op += nliterals;
+
+	if (!match)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	match -= LZ_MIN_MATCH;
+	*token |= match < 15 ? match : 15;
+	if (match >= 15 && !(op = lz_put_length(op, oend, match - 15)))
+		return NULL;
+
+	return op;
+}
+
+/*
+ * A single greedy pass with a small hash table of recently seen 4-byte
+ * strings.  That finds most of the repetition in kernel logs (repeated
+ * prefixes, register names, stack frames) at very little cost.
+ */
+int lz_compress(const void *src, int srclen, void *dst, int dstcap) {
+	const uint8_t *base = src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *iend = base + srclen;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dstcap;
+	int32_t table[1 << LZ_HASH_BITS];
+
+	memset(table, 0xff, sizeof(table));
+
+	while (srclen > LZ_MATCH_LIMIT && ip < iend - LZ_MATCH_LIMIT) {
+		uint32_t hash = lz_hash(lz_read32(ip));
+		int32_t pos = table[hash];
+		const uint8_t *ref;
+		uint32_t len;
+
+		table[hash] = ip - base;
+		if (pos < 0 || ip - base - pos > LZ_MAX_OFFSET
+		 || lz_read32(base + pos) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+		ref = base + pos;
+
+		while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		len = LZ_MIN_MATCH;
+		while (ip + len < iend - LZ_LAST_LITERALS && ip[len] == ref[len])
+			len++;
+
+		op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+int lz_decompress(const void *src, int srclen, void *dst, int dstcap) {
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + srclen;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dstcap;
+
+	while (ip < iend) {
+		uint32_t token = *ip++;
+		uint32_t len = token >> 4;
+		uint32_t offset;
+		const uint8_t *match;
+
+		if (len == 15) {
+			uint8_t b;
+
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+
+		if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (uint32_t)(op - (uint8_t *)dst))
+			return -1;
+
+		len = token & 15;
+		if (len == 15) {
+			uint8_t b;
+
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ_MIN_MATCH;
+
+		if (len > (uint32_t)(oend - op))
+			return -1;
+
+		/* Byte by byte, as the match may overlap what it produces */
+		match = op - offset;
+		while (len--)
+			*op++ = *match++;
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,16 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/*
+ * Compression in the LZ4 block format, so that anything with an LZ4
+ * decoder (the kernel, for one) can read the result.  Blocks are
+ * limited to 64 KiB of input.
+ */
+
+/* Returns the compressed size, or 0 if it won't fit in dstcap bytes */
+int lz_compress(const void *src, int srclen, void *dst, int dstcap);
+
+/* Returns the decompressed size, or -1 if src is not a valid block */
+int lz_decompress(const void *src, int srclen, void *dst, int dstcap);
+
+#endif /* __LZ_H__ */
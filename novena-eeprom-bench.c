@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "eeprom.h"
+
+/* Page sizes to try for write tests */
+static const int page_sizes[] = { 16, 32, 64, 128 };
+
+/* Read chunking strategies to try for read tests */
+static const struct chunking {
+	const char	*name;
+	uint32_t	chunk;
+	uint32_t	pack;
+} chunkings[] = {
+	{ .name = "single", .chunk = 32,   .pack = 1  },
+	{ .name = "packed", .chunk = 8192, .pack = 21 },
+};
+
+/* Simulated bus and part, overridable from the command line */
+static uint32_t bench_khz = 400;
+static uint32_t bench_twr_us = 5000;
+static uint32_t bench_chip_size = 65536;
+static uint32_t bench_restore_size = 4096;
+
+static char sim_file[] = "/tmp/novena-eeprom-bench.XXXXXX";
+static char image_file[] = "/tmp/novena-eeprom-image.XXXXXX";
+
+struct sample {
+	uint64_t		start_ns;
+	struct eeprom_stats	stats;
+	unsigned long		transactions;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static struct eeprom_dev *bench_open(int page_size,
+				     const struct chunking *chunking,
+				     int ack_poll_ms) {
+	struct eeprom_error err;
+	struct eeprom_dev *dev;
+	char spec[256];
+
+	snprintf(spec, sizeof(spec),
+		 "sim:%s,size=%u,page=%d,twr=%u,khz=%u,chunk=%u,pack=%u",
+		 sim_file, bench_chip_size, page_size, bench_twr_us,
+		 bench_khz, chunking->chunk, chunking->pack);
+
+	dev = eeprom_open(spec, 0, &err);
+	if (!dev) {
+		fprintf(stderr, "%s\n", err.message);
+		return NULL;
+	}
+
+	dev->ack_poll_ms = ack_poll_ms;
+	return dev;
+}
+
+static void sample_start(struct eeprom_dev *dev, struct sample *s) {
+	s->stats = dev->stats;
+	s->transactions = dev->be->transactions;
+	s->start_ns = now_ns();
+}
+
+static void sample_report(struct eeprom_dev *dev, struct sample *s,
+			  const char *op, int page_size, const char *wait,
+			  const char *chunk) {
+	uint64_t elapsed = now_ns() - s->start_ns;
+	unsigned long bytes;
+
+	bytes = (dev->stats.bytes_read - s->stats.bytes_read)
+	      + (dev->stats.bytes_written - s->stats.bytes_written);
+
+	printf("%-8s %5d %-6s %-7s %8lu %10.2f %12.0f %8lu %10.2f %10.2f\n",
+		op, page_size, wait, chunk, bytes,
+		elapsed / 1000000.0,
+		elapsed ? bytes * 1000000000.0 / elapsed : 0,
+		dev->be->transactions - s->transactions,
+		(dev->stats.xfer_ns - s->stats.xfer_ns) / 1000000.0,
+		(dev->stats.wait_ns - s->stats.wait_ns) / 1000000.0);
+}
+
+/* Fill the header image with a pattern that differs in every byte */
+static void bench_fill(struct eeprom_dev *dev, int page_size, uint8_t seed) {
+	uint8_t *buf = (uint8_t *)&dev->data;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(dev->data); i++)
+		buf[i] = seed + i;
+	dev->data.v2.page_size = page_size;
+}
+
+static int bench_make_image(uint8_t seed) {
+	uint8_t buf[STREAM_CHUNK];
+	uint32_t offset;
+	FILE *f;
+
+	f = fopen(image_file, "w");
+	if (!f) {
+		perror("Unable to create image");
+		return 1;
+	}
+
+	srand(seed);
+	for (offset = 0; offset < bench_restore_size; offset += sizeof(buf)) {
+		unsigned int i;
+		uint32_t count = sizeof(buf);
+
+		if (offset + count > bench_restore_size)
+			count = bench_restore_size - offset;
+		for (i = 0; i < count; i++)
+			buf[i] = rand();
+		if (fwrite(buf, count, 1, f) != 1) {
+			perror("Unable to create image");
+			fclose(f);
+			return 1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Header reads and whole-chip dumps, for each chunking strategy */
+static int bench_reads(void) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(chunkings) / sizeof(*chunkings); i++) {
+		const struct chunking *c = &chunkings[i];
+		struct eeprom_dev *dev;
+		struct sample s;
+
+		dev = bench_open(DEFAULT_PAGE_SIZE, c, 0);
+		if (!dev)
+			return 1;
+
+		sample_start(dev, &s);
+		if (eeprom_read(dev))
+			goto err;
+		sample_report(dev, &s, "read", DEFAULT_PAGE_SIZE, "-", c->name);
+
+		sample_start(dev, &s);
+		if (eeprom_dump(dev, "/dev/null", bench_chip_size))
+			goto err;
+		sample_report(dev, &s, "dump", DEFAULT_PAGE_SIZE, "-", c->name);
+
+		eeprom_close(&dev);
+		continue;
+
+err:
+		fprintf(stderr, "%s\n", dev->error.message);
+		eeprom_close(&dev);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Full header writes, single-field updates and partial restores, for
+ * each page size and write completion strategy.
+ */
+static int bench_writes(void) {
+	const struct chunking *c = &chunkings[1];
+	unsigned int i;
+	int poll;
+
+	for (i = 0; i < sizeof(page_sizes) / sizeof(*page_sizes); i++) {
+		for (poll = 0; poll < 2; poll++) {
+			int page_size = page_sizes[i];
+			const char *wait = poll ? "poll" : "sleep";
+			struct eeprom_dev *dev;
+			struct sample s;
+
+			dev = bench_open(page_size, c, poll ? ACK_POLL_TIMEOUT_MS : 0);
+			if (!dev)
+				return 1;
+
+			if (eeprom_read(dev))
+				goto err;
+
+			bench_fill(dev, page_size, poll ? 0x00 : 0x80);
+			sample_start(dev, &s);
+			if (eeprom_write(dev))
+				goto err;
+			sample_report(dev, &s, "write", page_size, wait, c->name);
+
+			dev->data.v2.serial++;
+			sample_start(dev, &s);
+			if (eeprom_write(dev))
+				goto err;
+			sample_report(dev, &s, "update", page_size, wait, c->name);
+
+			if (bench_make_image(page_size + poll))
+				goto err;
+			sample_start(dev, &s);
+			if (eeprom_restore(dev, image_file, bench_chip_size,
+					   page_size))
+				goto err;
+			sample_report(dev, &s, "restore", page_size, wait, c->name);
+
+			eeprom_close(&dev);
+			continue;
+
+err:
+			if (dev->error.code)
+				fprintf(stderr, "%s\n", dev->error.message);
+			eeprom_close(&dev);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int print_usage(char *name) {
+	printf("Usage:\n"
+	"  %s [-k khz] [-t twr] [-l size] [-r restore-size]\n"
+	"\n"
+	"Benchmark EEPROM access against a simulated part.\n"
+	"\n"
+	"    -k    Simulated bus clock in kHz (default %u)\n"
+	"    -t    Simulated write cycle time in us (default %u)\n"
+	"    -l    Simulated EEPROM size (default %u)\n"
+	"    -r    Number of bytes to restore in restore tests (default %u)\n"
+	"    -h    Print this help message\n"
+	"\n", name, bench_khz, bench_twr_us, bench_chip_size,
+	bench_restore_size);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int ch;
+	int fd;
+	int ret;
+
+	while ((ch = getopt(argc, argv, "hk:t:l:r:")) != -1) {
+		switch(ch) {
+		case 'k':
+			bench_khz = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			bench_twr_us = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			bench_chip_size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			bench_restore_size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'h':
+			print_usage(argv[0]);
+			return 1;
+
+		default:
+			printf("Unrecognized option: %c\n", ch);
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (bench_restore_size > bench_chip_size)
+		bench_restore_size = bench_chip_size;
+
+	fd = mkstemp(sim_file);
+	if (fd == -1) {
+		perror("Unable to create simulated EEPROM");
+		return 1;
+	}
+	close(fd);
+
+	fd = mkstemp(image_file);
+	if (fd == -1) {
+		perror("Unable to create image");
+		unlink(sim_file);
+		return 1;
+	}
+	close(fd);
+
+	printf("Simulated %u-byte EEPROM, %u kHz bus, %u us write cycle\n\n",
+		bench_chip_size, bench_khz, bench_twr_us);
+	printf("%-8s %5s %-6s %-7s %8s %10s %12s %8s %10s %10s\n",
+		"op", "page", "wait", "chunk", "bytes", "time(ms)", "bytes/s",
+		"xfers", "xfer(ms)", "wait(ms)");
+
+	ret = bench_reads() || bench_writes();
+
+	unlink(sim_file);
+	unlink(image_file);
+	return ret;
+}
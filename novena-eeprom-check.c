@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "novena-eeprom.h"
+#include "crc32.h"
+
+/*
+ * Everything here works on the raw bytes read from the chip, and needs
+ * nothing beyond crc32(), so it can be lifted as-is into a bootloader
+ * or kernel that has its own zlib-compatible crc32().
+ */
+int novena_eeprom_check(const void *data, uint32_t len) {
+	const struct novena_eeprom_data_v3 *v3 = data;
+	const uint8_t *bytes = data;
+	uint32_t header_length;
+	uint32_t header_crc;
+
+	if (len < sizeof(*v3))
+		return 1;
+
+	if (memcmp(v3->signature, NOVENA_SIGNATURE, sizeof(v3->signature))
+	 || v3->version < 3)
+		return 1;
+
+	header_length = v3->header_length;
+	if (header_length < sizeof(*v3) || header_length > len)
+		return 1;
+
+	memcpy(&header_crc, bytes + header_length - sizeof(header_crc),
+	       sizeof(header_crc));
+	if (crc32(0, data, header_length - sizeof(header_crc)) != header_crc)
+		return 1;
+
+	return 0;
+}
+
+int novena_eeprom_pick_slot(const void *slot_a, const void *slot_b,
+			    uint32_t len) {
+	const struct novena_eeprom_data_v3 *a = slot_a;
+	const struct novena_eeprom_data_v3 *b = slot_b;
+	int a_valid = !novena_eeprom_check(slot_a, len);
+	int b_valid = !novena_eeprom_check(slot_b, len);
+
+	/* The sequence number may have wrapped */
+	if (a_valid && b_valid)
+		return (int32_t)(b->sequence - a->sequence) > 0;
+	if (a_valid)
+		return 0;
+	if (b_valid)
+		return 1;
+	return -1;
+}
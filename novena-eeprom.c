@@ -3,341 +3,28 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "novena-eeprom.h"
+#include "eeprom.h"
+#include "eeprom-pool.h"
+#include "eeprom-batch.h"
+#include "eeprom-oops.h"
+#include "eeprom-scan.h"
 
 #define EEPROM_ADDRESS (0xac>>1)
 #define I2C_BUS "/dev/i2c-2"
 
-union novena_eeprom_data {
-	struct novena_eeprom_data_v1	v1;
-	struct novena_eeprom_data_v2	v2;
-};
-
-struct eeprom_dev {
-	/* File handle to I2C bus */
-	int				fd;
-
-	/* I2C address of the EEPROM */
-	int				addr;
-
-	/* True, if we've read the contents of eeprom */
-	int				cached;
-
-	/* Contents of the EEPROM */
-	union novena_eeprom_data 	data;
-};
-
-int parse_features(char *str) {
-	char *ctx;
-	char *sep = ",";
-	char *word;
-	uint16_t flags = 0;
-
-	for (word = strtok_r(str, sep, &ctx);
-	     word;
-	     word = strtok_r(NULL, sep, &ctx)) {
-
-		struct feature *feature = features;
-		while (feature->name) {
-			if (!strcmp(feature->name, word)) {
-				flags |= feature->flags;
-				break;
-			}
-			feature++;
-		}
-		if (!feature->name) {
-			fprintf(stderr, "Unrecognized feature \"%s\"\n", word);
-			return -1;
-		}
-	}
-	return flags;
-}
-
-int parse_mac(char *str, void *out) {
-	int i;
-	char *mac = out;
-	for (i=0; i<6; i++) {
-		if (!isdigit(str[0]) &&
-			(tolower(str[0]) < 'a' || tolower(str[0]) > 'f')) {
-			printf("Unable to parse MAC address\n");
-			return 1;
-		}
-		if (!isdigit(str[1]) &&
-			(tolower(str[1]) < 'a' || tolower(str[1]) > 'f')) {
-			printf("Unable to parse MAC address\n");
-			return 1;
-		}
-
-		*mac = strtoul(str, NULL, 16);
-		mac++;
-		str+=2;
-		if (*str == '-' || *str == ':' || *str == '.')
-			str++;
-	}
-	if (*str) {
-		printf("Unable to parse MAC address\n");
-		return 1;
-	}
-	return 0;
-}
-
-int eeprom_read_i2c(struct eeprom_dev *dev, int addr, void *data, int count) {
-	struct i2c_rdwr_ioctl_data session;
-	struct i2c_msg messages[2];
-	char set_addr_buf[2];
-
-	memset(set_addr_buf, 0, sizeof(set_addr_buf));
-	memset(data, 0, count);
-
-	set_addr_buf[0] = addr>>8;
-	set_addr_buf[1] = addr;
-
-	messages[0].addr = dev->addr;
-	messages[0].flags = 0;
-	messages[0].len = sizeof(set_addr_buf);
-	messages[0].buf = set_addr_buf;
-
-	messages[1].addr = dev->addr;
-	messages[1].flags = I2C_M_RD;
-	messages[1].len = count;
-	messages[1].buf = data;
-
-	session.msgs = messages;
-	session.nmsgs = 2;
-
-	if(ioctl(dev->fd, I2C_RDWR, &session) < 0) {
-		perror("Unable to communicate with i2c device");
-		return 1;
-	}
-
-	return 0;
-}
-
-int eeprom_write_i2c(struct eeprom_dev *dev, int addr, const void *data, int count) {
-	struct i2c_rdwr_ioctl_data session;
-	struct i2c_msg messages[1];
-	char data_buf[2+count];
-
-	data_buf[0] = addr>>8;
-	data_buf[1] = addr;
-	memcpy(&data_buf[2], data, count);
-
-	messages[0].addr = dev->addr;
-	messages[0].flags = 0;
-	messages[0].len = sizeof(data_buf);
-	messages[0].buf = data_buf;
-
-	session.msgs = messages;
-	session.nmsgs = 1;
-
-	if(ioctl(dev->fd, I2C_RDWR, &session) < 0) {
-		perror("Unable to communicate with i2c device");
-		return 1;
-	}
-
-	return 0;
-}
-
-int eeprom_read(struct eeprom_dev *dev) {
-	int ret;
-
-	if (dev->cached)
-		return 0;
-
-	ret = eeprom_read_i2c(dev, 0, &dev->data, sizeof(dev->data));
-	if (ret)
-		return ret;
-
-	dev->cached = 1;
-	return 0;
-}
-
-int eeprom_write(struct eeprom_dev *dev) {
-	const char *buffer = (const char *)&dev->data;
-	unsigned int buffer_offset = 0;
-	int page_size = dev->data.v2.page_size;
-	int ret;
-
-	dev->cached = 1;
-	while (buffer_offset < sizeof(dev->data)) {
-		if ((buffer_offset + page_size) > sizeof(dev->data))
-			page_size = sizeof(dev->data) - buffer_offset;
-
-		ret = eeprom_write_i2c(dev, buffer_offset,
-				       buffer + buffer_offset, page_size);
-		if (ret)
-			break;
-
-		buffer_offset += page_size;
-		usleep(10000);
-	}
-
-	return ret;
-}
-
-static int eeprom_export(struct eeprom_dev *dev, const char *filename) {
-	FILE *f;
-	int ret;
-
-	/* Ensure we have a cached copy */
-	if (eeprom_read(dev) != 0)
-		return 1;
-
-	f = fopen(filename, "w");
-	if (NULL == f) {
-		perror("Unable to open file for exporting");
-		return 1;
-	}
-
-	ret = fwrite(&dev->data, sizeof(dev->data), 1, f);
-	if (ret != 1) {
-		perror("Unable to export");
-		fclose(f);
-		return 1;
-	}
-
-	fclose(f);
-	return 0;
-}
-
-static int eeprom_import(struct eeprom_dev *dev, const char *filename) {
-	FILE *f;
-	int ret;
-
-	f = fopen(filename, "r");
-	if (NULL == f) {
-		perror("Unable to open file for importing");
-		return 1;
-	}
-
-	ret = fread(&dev->data, sizeof(dev->data), 1, f);
-	if (ret != 1) {
-		perror("Unable to import");
-		fclose(f);
-		return 1;
-	}
-
-	fclose(f);
-
-	/* Mark the copy as cached, so it won't get re-read */
-	dev->cached = 1;
-
-	return 0;
-}
-
-struct eeprom_dev *eeprom_open(char *path, int addr) {
-	struct eeprom_dev *dev;
-
-	dev = malloc(sizeof(*dev));
-	if (!dev) {
-		perror("Unable to alloc data");
-		goto malloc_err;
-	}
-
-	memset(dev, 0, sizeof(*dev));
-
-	dev->fd = open(path, O_RDWR);
-	if (dev->fd == -1) {
-		perror("Unable to open i2c device");
-		goto open_err;
-	}
-
-	dev->addr = addr;
-
-	return dev;
-
-open_err:
-	free(dev);
-malloc_err:
-	return NULL;
-}
-
-static void eeprom_get_defaults(struct eeprom_dev *dev) {
-	memset(&dev->data.v2, 0, sizeof(dev->data.v2));
-
-	memcpy(dev->data.v2.signature, NOVENA_SIGNATURE, sizeof(dev->data.v2.signature));
-
-	memset(&dev->data.v2.mac, 0xff, sizeof(dev->data.v2.mac));
-
-	dev->data.v2.version = 2;
-
-	dev->data.v2.features = feature_es8328 | feature_pcie | feature_gbit |
-		     feature_hdmi | feature_retina | feature_eepromoops;
-
-	dev->data.v2.eepromoops_offset = 4096;
-	dev->data.v2.eepromoops_length = 61440;
-
-	dev->data.v2.eeprom_size = 65536;
-	dev->data.v2.page_size = 128;
-
-	dev->data.v2.lvds1.frequency = 148500000;
-	dev->data.v2.lvds1.hactive = 1920;
-	dev->data.v2.lvds1.vactive = 1080;
-	dev->data.v2.lvds1.hback_porch = 148;
-	dev->data.v2.lvds1.hfront_porch = 88;
-	dev->data.v2.lvds1.hsync_len = 44;
-	dev->data.v2.lvds1.vback_porch = 36;
-	dev->data.v2.lvds1.vfront_porch = 4;
-	dev->data.v2.lvds1.vsync_len = 5;
-	dev->data.v2.lvds1.flags = vsync_polarity | hsync_polarity | data_width_8bit
-		      | mapping_jeida | dual_channel | channel_present;
-
-	dev->data.v2.lvds2.flags = channel_present;
-
-	/* Pull HDMI settings from e.g. EDID */
-	dev->data.v2.hdmi.flags = channel_present | ignore_settings | data_width_8bit;
-}
-
-static void eeprom_upgrade_v1_to_v2(struct eeprom_dev *dev) {
-	if (dev->data.v2.version != 1)
+/*
+ * Report why the last library call on dev failed, once: the reason is
+ * cleared, so a later failure further up doesn't print it again.
+ */
+static void print_error(struct eeprom_dev *dev) {
+	if (!dev->error.code)
 		return;
-
-        dev->data.v2.features |= feature_eepromoops;
-
-        dev->data.v2.eepromoops_offset = 4096;
-        dev->data.v2.eepromoops_length = 61440;
-
-        dev->data.v2.eeprom_size = 65536;
-        dev->data.v2.page_size = 128;
-
-        if (dev->data.v2.features & feature_retina) {
-            dev->data.v2.lvds1.frequency = 148500000;
-            dev->data.v2.lvds1.hactive = 1920;
-            dev->data.v2.lvds1.vactive = 1080;
-            dev->data.v2.lvds1.hback_porch = 148;
-            dev->data.v2.lvds1.hfront_porch = 88;
-            dev->data.v2.lvds1.hsync_len = 44;
-            dev->data.v2.lvds1.vback_porch = 36;
-            dev->data.v2.lvds1.vfront_porch = 4;
-            dev->data.v2.lvds1.vsync_len = 5;
-            dev->data.v2.lvds1.flags = vsync_polarity | hsync_polarity
-				     | data_width_8bit | mapping_jeida
-				     | dual_channel | channel_present;
-
-            dev->data.v2.lvds2.flags = channel_present;
-        }
-
-        if (dev->data.v2.features & feature_hdmi) {
-		/* Pull HDMI settings from e.g. EDID */
-		dev->data.v2.hdmi.flags = channel_present | ignore_settings
-					| data_width_8bit;
-        }
-
-        dev->data.v2.version = 2;
-}
-
-int eeprom_close(struct eeprom_dev **dev) {
-	if (!dev || !*dev)
-		return 0;
-	close((*dev)->fd);
-	free(*dev);
-	*dev = NULL;
-	return 0;
+	fprintf(stderr, "%s\n", dev->error.message);
+	dev->error.code = eeprom_err_none;
 }
 
 int print_usage(char *name) {
@@ -360,13 +47,46 @@ int print_usage(char *name) {
 	"    -2    LVDS channel 2 modeline\n"
 	"    -d    HDMI modeline\n"
 	"    -w    Actually write the value to the EEPROM\n"
+	"    -a    Poll for write completion, with a timeout in ms (0 for default)\n"
+	"    -V    Read back every written page and check its CRC\n"
+	"    -R    Retries of transient bus errors, optionally with the longest\n"
+	"          backoff in ms (default %d,%d; 0 to fail at once)\n"
 	"    -e    Export EEPROM to file\n"
 	"    -i    Import EEPROM from file\n"
+	"    -E    Dump the entire EEPROM chip to file\n"
+	"    -I    Restore the entire EEPROM chip from file (requires -w)\n"
+	"    -D    Device to use: an I2C bus, an at24 sysfs eeprom file, or\n"
+	"          sim:file[,size=N][,page=N][,twr=us][,nowrap][,khz=N]\n"
+	"          [,chunk=N][,pack=N][,write=N] (default %s).  An I2C\n"
+	"          address may be appended as @addr\n"
+	"    -T    Add a device (as for -D) to work on concurrently.  May be\n"
+	"          given several times\n"
+	"    -j    Number of -T devices to work on at once (default all)\n"
+	"    -B    Provision the -T devices from a manifest (requires -w)\n"
+	"    -C    Cache the EEPROM image in this directory (e.g. /run/novena-eeprom)\n"
+	"    -g    Print only these comma-separated fields, as name=value\n"
+	"    -O    Print eepromoops records added since the last run, keeping\n"
+	"          track in this cursor file (- to print them all)\n"
+	"    -A    Append this file (- for stdin) to the eepromoops area as a\n"
+	"          record (requires -w).  May be given several times\n"
+	"    -x    Erase offset,length, the oops area (oops) or the whole chip\n"
+	"          (all) to 0xff, skipping pages already erased (requires -w)\n"
+	"    -t    Print the key record, or with key=value set it (requires -w).\n"
+	"          An empty value removes the record.  May be given several\n"
+	"          times\n"
+	"    -P    Probe the real page size and capacity using the 256-byte\n"
+	"          block at this offset, which is restored afterwards.  With\n"
+	"          -w, correct the header to match\n"
+	"    -F    List the Novena EEPROMs on every I2C bus, probing addresses\n"
+	"          0x50-0x57 on all buses at once.  With -D, just that bus,\n"
+	"          even if it can only do SMBus\n"
+	"    -S    Print bus timing statistics on stderr when done, as text\n"
+	"          or json\n"
 	"    -h    Print this help message\n"
-	"\n", name);
+	"\n", name, RETRY_DEFAULT_COUNT, RETRY_DEFAULT_MAX_MS, I2C_BUS);
 
 	printf("Valid features:\n");
-	struct feature *feature = features;
+	const struct feature *feature = eeprom_features;
 	while (feature->name) {
 		printf("    %-16s%s\n", feature->name, feature->descr);
 		feature++;
@@ -380,8 +100,16 @@ int print_usage(char *name) {
 	printf("    -1 'Modeline \"lvds1\" 148.500  1920 2068 2156 2200   1080 1116 1120 1125 +HSync +VSync channel_present dual_channel mapping_jeida data_width_8bit'\n");
 	printf("\n");
 
+	printf("Valid fields for -g (or \"all\"):\n   ");
+	const struct eeprom_field *field = eeprom_fields;
+	while (field->name) {
+		printf(" %s", field->name);
+		field++;
+	}
+	printf("\n\n");
+
 	printf("Valid modeline flags:\n");
-	struct available_modesetting_flags *ms = available_modesetting_flags;
+	const struct available_modesetting_flags *ms = eeprom_modesetting_flags;
 	while (ms->name) {
 		printf("    %-25s%s\n", ms->name, ms->descr);
 		ms++;
@@ -413,7 +141,8 @@ static void print_modesetting(struct modesetting *m, const char *name) {
 	if (m->flags) {
 		int matched = 0;
 		int flags = m->flags;
-		struct available_modesetting_flags *feature = available_modesetting_flags;
+		const struct available_modesetting_flags *feature =
+			eeprom_modesetting_flags;
 		while (feature->name) {
 			if (feature->flags & flags) {
 				if (!matched)
@@ -456,7 +185,7 @@ int print_eeprom_data(struct eeprom_dev *dev) {
 	if (dev->data.v1.features) {
 		int matched = 0;
 		int flags = dev->data.v1.features;
-		struct feature *feature = features;
+		const struct feature *feature = eeprom_features;
 		while (feature->name) {
 			if (feature->flags & flags) {
 				if (!matched)
@@ -475,7 +204,7 @@ int print_eeprom_data(struct eeprom_dev *dev) {
 	}
 	printf("\n");
 
-	if (dev->data.v2.version == 2) {
+	if (dev->data.v2.version >= 2) {
 		struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
 
 		printf("\tEEPROM size:      %d\n", dev->data.v2.eeprom_size);
@@ -492,158 +221,1084 @@ int print_eeprom_data(struct eeprom_dev *dev) {
 		printf("\tHDMI channel:\n");
 		print_modesetting(&v2->hdmi, "hdmi");
 	}
+
+	if (dev->data.v3.version >= 3) {
+		printf("\tHeader slot:      %c (sequence %u)\n",
+				'A' + dev->active_slot, dev->data.v3.sequence);
+		printf("\tHeader length:    %d\n", dev->data.v3.header_length);
+		printf("\tHeader CRC:       0x%08x (%s)\n",
+				dev->data.v3.header_crc,
+				novena_eeprom_check(&dev->data,
+						    sizeof(dev->data))
+					? "BAD" : "ok");
+	}
 	return 0;
 }
 
-static int parse_modesetting(struct modesetting *m, const char *arg) {
-	int len;
-	float mhz;
-	uint32_t h1, h2, h3, h4;
-	uint32_t v1, v2, v3, v4;
-	
-	sscanf(arg, "%*s %*s %f %u %u %u %u %u %u %u %d %n",
-			&mhz, &h1, &h2, &h3, &h4, &v1, &v2, &v3, &v4, &len);
-
-	m->frequency = mhz * 1000000;
-
-	m->hactive = h1;
-	m->hback_porch = h2 - m->hactive;
-	m->hfront_porch = h3 - m->hactive - m->hback_porch;
-	m->hsync_len = h4 - m->hactive - m->hback_porch - m->hfront_porch;
-
-	m->vactive = v1;
-	m->vback_porch = v2 - m->vactive;
-	m->vfront_porch = v3 - m->vactive - m->vback_porch;
-	m->vsync_len = v4 - m->vactive - m->vback_porch - m->vfront_porch;
-
-	m->flags = 0;
-
-	char flagstr[strlen(arg + len) + 1];
-	char *flag;
-	char *tmp = flagstr;
-
-	memcpy(flagstr, arg + len, sizeof(flagstr));
-
-	while ((flag = strtok(tmp, " ")) != NULL) {
-		tmp = NULL;
-
-		if (!strcasecmp(flag, "+hsync"))
-			m->flags |= hsync_polarity;
-		else if (!strcasecmp(flag, "-hsync"))
-			m->flags &= ~hsync_polarity;
-		if (!strcasecmp(flag, "+vsync"))
-			m->flags |= vsync_polarity;
-		else if (!strcasecmp(flag, "-vsync"))
-			m->flags &= ~vsync_polarity;
-		else {
-			struct available_modesetting_flags *feature = available_modesetting_flags;
-			while (feature->name) {
-				if (!strcasecmp(feature->name, flag)) {
-					m->flags |= feature->flags;
-					break;
-				}
-				feature++;
+/* Parse a comma-separated list of field names into a mask of eeprom_fields[] */
+static int parse_fields(char *str, uint32_t *mask) {
+	char *ctx;
+	char *sep = ",";
+	char *word;
+
+	*mask = 0;
+	for (word = strtok_r(str, sep, &ctx);
+	     word;
+	     word = strtok_r(NULL, sep, &ctx)) {
+		int i;
+
+		if (!strcmp(word, "all")) {
+			for (i = 0; eeprom_fields[i].name; i++)
+				*mask |= 1 << i;
+			continue;
+		}
+
+		for (i = 0; eeprom_fields[i].name; i++) {
+			if (!strcmp(eeprom_fields[i].name, word)) {
+				*mask |= 1 << i;
+				break;
 			}
 		}
+		if (!eeprom_fields[i].name) {
+			fprintf(stderr, "Unrecognized field \"%s\"\n", word);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Print a modesetting as a single line, in the form -1/-2/-d accept */
+static void print_modeline(struct modesetting *m, const char *name) {
+	const struct available_modesetting_flags *flag =
+		eeprom_modesetting_flags;
+
+	printf("Modeline \"%s\" %0.3f %d %d %d %d %d %d %d %d %cHSync %cVSync",
+		name,
+		m->frequency / 1000000.0,
+		m->hactive,
+		m->hactive + m->hback_porch,
+		m->hactive + m->hback_porch + m->hfront_porch,
+		m->hactive + m->hback_porch + m->hfront_porch + m->hsync_len,
+		m->vactive,
+		m->vactive + m->vback_porch,
+		m->vactive + m->vback_porch + m->vfront_porch,
+		m->vactive + m->vback_porch + m->vfront_porch + m->vsync_len,
+		(m->flags & hsync_polarity) ? '+' : '-',
+		(m->flags & vsync_polarity) ? '+' : '-');
 
+	while (flag->name) {
+		if ((m->flags & flag->flags)
+		 && flag->flags != hsync_polarity
+		 && flag->flags != vsync_polarity)
+			printf(" %s", flag->name);
+		flag++;
+	}
+}
+
+/* Print the fields in mask as name=value lines, for use in scripts */
+static int print_fields(struct eeprom_dev *dev, uint32_t mask) {
+	struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
+	int ret = 0;
+	int i;
+
+	if (eeprom_read_fields(dev, mask))
+		return 1;
+
+	for (i = 0; eeprom_fields[i].name; i++) {
+		const char *name = eeprom_fields[i].name;
+
+		if (!(mask & (1 << i)))
+			continue;
+
+		if (v2->version < eeprom_fields[i].min_version) {
+			fprintf(stderr, "No %s field in a v%d EEPROM\n",
+					name, v2->version);
+			ret = 1;
+			continue;
+		}
+
+		printf("%s=", name);
+		if (!strcmp(name, "signature"))
+			printf("%.6s", v2->signature);
+		else if (!strcmp(name, "version"))
+			printf("%d", v2->version);
+		else if (!strcmp(name, "page_size"))
+			printf("%d", v2->page_size);
+		else if (!strcmp(name, "serial"))
+			printf("%u", v2->serial);
+		else if (!strcmp(name, "mac"))
+			printf("%02x:%02x:%02x:%02x:%02x:%02x",
+				v2->mac[0], v2->mac[1], v2->mac[2],
+				v2->mac[3], v2->mac[4], v2->mac[5]);
+		else if (!strcmp(name, "features"))
+			printf("0x%04x", v2->features);
+		else if (!strcmp(name, "lvds1"))
+			print_modeline(&v2->lvds1, "lvds1");
+		else if (!strcmp(name, "lvds2"))
+			print_modeline(&v2->lvds2, "lvds2");
+		else if (!strcmp(name, "hdmi"))
+			print_modeline(&v2->hdmi, "hdmi");
+		else if (!strcmp(name, "eeprom_size"))
+			printf("%u", v2->eeprom_size);
+		else if (!strcmp(name, "oops_offset"))
+			printf("%u", v2->eepromoops_offset);
+		else if (!strcmp(name, "oops_length"))
+			printf("%u", v2->eepromoops_length);
+		else if (!strcmp(name, "sequence"))
+			printf("%u", dev->data.v3.sequence);
+		else if (!strcmp(name, "header_length"))
+			printf("%u", dev->data.v3.header_length);
+		else if (!strcmp(name, "header_crc"))
+			printf("0x%08x", dev->data.v3.header_crc);
+		printf("\n");
+	}
+
+	return ret;
+}
+
+/* Get or set each -t key[=value] record, in order */
+static int run_records(struct eeprom_dev *dev, char **records, int nrecords,
+		       int writing) {
+	static uint8_t value[65535];
+	int i;
+
+	for (i = 0; i < nrecords; i++) {
+		char *key = records[i];
+		char *set = strchr(key, '=');
+		uint32_t len = sizeof(value);
+
+		if (!set) {
+			if (eeprom_tlv_get(dev, key, value, &len))
+				return 1;
+			printf("%s=", key);
+			fwrite(value, len, 1, stdout);
+			printf("\n");
+			continue;
+		}
+
+		*set++ = '\0';
+		if (!writing) {
+			printf("Not setting %s, as -w was not specified\n", key);
+			return 1;
+		}
+		if (eeprom_tlv_set(dev, key, set, strlen(set)))
+			return 1;
+		printf("%s record %s (%d pages written, %d unchanged pages "
+			"skipped)\n", key, *set ? "set" : "removed",
+			dev->pages_written, dev->pages_skipped);
 	}
 
 	return 0;
 }
 
+/* Running totals for the records printed by print_oops() */
+struct oops_totals {
+	int				records;
+	uint32_t			bytes;
+	uint32_t			bytes_stored;
+};
+
+/* eeprom_oops_read() callback: print one record */
+static int print_oops(void *arg, const struct novena_oops_record *record,
+		      const void *payload, uint32_t len) {
+	struct oops_totals *totals = arg;
+	const char *text = payload;
+
+	printf("=== oops %u", record->sequence);
+	if (record->timestamp) {
+		time_t when = record->timestamp;
+		char stamp[32];
+		struct tm tm;
+
+		gmtime_r(&when, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		printf(" at %s", stamp);
+	}
+	printf(", %u bytes", len);
+	if (record->flags & oops_lz4)
+		printf(", %u compressed", record->length);
+	printf(" ===\n");
+
+	fwrite(payload, len, 1, stdout);
+	if (len && text[len - 1] != '\n')
+		printf("\n");
+
+	totals->records++;
+	totals->bytes += len;
+	totals->bytes_stored += record->length;
+	return 0;
+}
+
+/*
+ * Print the oops records written since the last run, as recorded in
+ * cursor_path ("-" prints them all and records nothing).  The cursor is
+ * only moved on once the records are safely out.
+ */
+static int read_oops(struct eeprom_dev *dev, const char *cursor_path) {
+	struct eeprom_oops_cursor cursor;
+	struct oops_totals totals;
+	struct eeprom_error err;
+	int keep = strcmp(cursor_path, "-");
+	int ret;
+
+	memset(&cursor, 0, sizeof(cursor));
+	memset(&totals, 0, sizeof(totals));
+	if (keep && eeprom_oops_cursor_load(cursor_path, &cursor, &err)) {
+		fprintf(stderr, "%s\n", err.message);
+		return 1;
+	}
+
+	ret = eeprom_oops_read(dev, &cursor, print_oops, &totals);
+	if (cursor.lost)
+		fprintf(stderr, "%u oops records were overwritten before they "
+				"could be read\n", cursor.lost);
+	if (cursor.skipped)
+		fprintf(stderr, "%u oops records didn't decompress, and were "
+				"skipped\n", cursor.skipped);
+
+	/* On stderr, so stdout holds nothing but the records */
+	if (totals.records)
+		fprintf(stderr, "%d oops records, %u bytes stored as %u "
+				"(%.2f:1)\n", totals.records, totals.bytes,
+				totals.bytes_stored,
+				(double)totals.bytes / totals.bytes_stored);
+
+	if (fflush(stdout) || ferror(stdout)) {
+		perror("Unable to print oops records");
+		return 1;
+	}
+
+	if (keep && eeprom_oops_cursor_save(cursor_path, &cursor, &err)) {
+		fprintf(stderr, "%s\n", err.message);
+		return 1;
+	}
+	return ret;
+}
+
+/* Append each file (- for stdin) as an oops record, all in one batch */
+static int append_oops(struct eeprom_dev *dev, char **files, int nfiles,
+		       int writing) {
+	struct iovec *records;
+	int ret = 1;
+	int i;
+
+	if (!writing) {
+		printf("Not appending oops records, as -w was not specified\n");
+		return 1;
+	}
+
+	records = calloc(nfiles, sizeof(*records));
+	if (!records) {
+		perror("Unable to alloc data");
+		return 1;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		FILE *f = strcmp(files[i], "-") ? fopen(files[i], "r") : stdin;
+		char *buffer;
+		size_t len;
+
+		if (NULL == f) {
+			perror("Unable to open oops record");
+			goto out;
+		}
+
+		/* One more byte than fits, to catch files that are too big */
+		buffer = malloc(65536);
+		if (!buffer) {
+			perror("Unable to alloc data");
+			goto out;
+		}
+		len = fread(buffer, 1, 65536, f);
+		if (f != stdin)
+			fclose(f);
+
+		records[i].iov_base = buffer;
+		records[i].iov_len = len;
+	}
+
+	ret = eeprom_oops_append(dev, records, nfiles);
+	if (!ret)
+		printf("Appended %d oops records, %u bytes stored as %u "
+			"(%.2f:1, %d pages written)\n", nfiles,
+			dev->oops_bytes, dev->oops_bytes_stored,
+			dev->oops_bytes_stored ? (double)dev->oops_bytes
+					/ dev->oops_bytes_stored : 1.0,
+			dev->pages_written);
+
+out:
+	for (i = 0; i < nfiles; i++)
+		free(records[i].iov_base);
+	free(records);
+	return ret;
+}
+
+/*
+ * Probe the real geometry using the scratch block, and bring the header
+ * into line with it if writing.
+ */
+/* Say what eeprom_prepare() found, before it's overwritten */
+static void print_origin(struct eeprom_dev *dev, enum eeprom_origin origin) {
+	switch (origin) {
+	case eeprom_origin_v1:
+		printf("Updating v1 EEPROM to v3...\n");
+		break;
+	case eeprom_origin_v2:
+		printf("Updating v2 EEPROM to v3...\n");
+		break;
+	case eeprom_origin_corrupt:
+		fprintf(stderr,
+			"EEPROM header CRC doesn't match, "
+			"overwriting with defaults\n");
+		break;
+	case eeprom_origin_blank:
+		printf("Blank EEPROM found, setting defaults...\n");
+		break;
+	case eeprom_origin_unknown:
+		fprintf(stderr,
+			"Unrecognized EEPROM version found "
+			"(v%d), overwriting with v3\n",
+			dev->data.v1.version);
+		break;
+	default:
+		break;
+	}
+}
+
+static int probe_geometry(struct eeprom_dev *dev, uint32_t scratch,
+			  int writing) {
+	struct eeprom_update update;
+	enum eeprom_origin origin;
+	uint32_t size;
+	int page_size;
+
+	if (eeprom_probe_geometry(dev, scratch, &size, &page_size))
+		return 1;
+
+	if (page_size)
+		printf("Probed geometry: %u bytes, %d-byte pages\n", size,
+			page_size);
+	else
+		printf("Probed geometry: %u bytes, unknown page size (at "
+			"least %d bytes)\n", size, EEPROM_PROBE_BLOCK);
+
+	if (eeprom_prepare(dev, &origin))
+		return 1;
+
+	/*
+	 * Correcting the geometry of a header that couldn't be read would
+	 * replace it with defaults, losing the serial and MAC.  That takes
+	 * a deliberate write without -P.
+	 */
+	if (origin == eeprom_origin_corrupt || origin == eeprom_origin_blank
+	 || origin == eeprom_origin_unknown) {
+		fprintf(stderr, "EEPROM header is %s, not correcting it; "
+				"write a header without -P first\n",
+				origin == eeprom_origin_corrupt ? "corrupt"
+				: origin == eeprom_origin_blank ? "blank"
+				: "an unrecognized version");
+		return writing;
+	}
+
+	/* A page size too big to tell is left as the header has it */
+	if (origin == eeprom_origin_v3
+	 && dev->data.v2.eeprom_size == size
+	 && (!page_size || dev->data.v2.page_size == page_size)) {
+		printf("Header already matches\n");
+		return 0;
+	}
+
+	if (origin == eeprom_origin_v3)
+		printf("Header says %u bytes, %d-byte pages\n",
+			dev->data.v2.eeprom_size, dev->data.v2.page_size);
+	if (!writing) {
+		printf("Not correcting the header, as -w was not specified\n");
+		return 0;
+	}
+
+	memset(&update, 0, sizeof(update));
+	update.fields = update_total_size;
+	update.data.eeprom_size = size;
+	if (page_size) {
+		update.fields |= update_page_size;
+		update.data.page_size = page_size;
+	}
+	print_origin(dev, origin);
+	eeprom_apply_update(dev, &update);
+
+	if (eeprom_write(dev)) {
+		print_error(dev);
+		printf("EEPROM write failed\n");
+		return 1;
+	}
+	printf("Header corrected (%d pages written)\n", dev->pages_written);
+	return 0;
+}
+
+/* Split "path[@addr]" in place, leaving addr alone if none is given */
+static int parse_target(char *str, int *addr) {
+	char *at = strrchr(str, '@');
+	char *end;
+
+	if (!at)
+		return 0;
+
+	*at = '\0';
+	*addr = strtoul(at + 1, &end, 0);
+	if (at[1] == '\0' || *end || *addr < 0x03 || *addr > 0x77) {
+		fprintf(stderr, "Invalid I2C address \"%s\"\n", at + 1);
+		return 1;
+	}
+	return 0;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * List every Novena EEPROM on every bus, or just on bus if the user
+ * named one, in a form -D and -T accept.  SMBus-only adapters are only
+ * scanned when named.
+ */
+static int scan(const char *bus) {
+	struct eeprom_scan_hit *hits;
+	struct eeprom_error err;
+	uint64_t start = now_ns();
+	int nhits;
+	int i;
+
+	memset(&err, 0, sizeof(err));
+	if (eeprom_scan(bus ? bus : SCAN_BUSES, bus != NULL, &hits, &nhits,
+			&err)) {
+		fprintf(stderr, "%s\n", err.message);
+		return 1;
+	}
+	if (err.code)
+		fprintf(stderr, "%s\n", err.message);
+
+	for (i = 0; i < nhits; i++)
+		printf("%s@0x%02x: Novena EEPROM, v%d header\n",
+			hits[i].path, hits[i].addr, hits[i].version);
+	printf("Found %d Novena EEPROMs in %.1f ms\n", nhits,
+		(now_ns() - start) / 1000000.0);
+
+	free(hits);
+	return nhits == 0;
+}
+
+/* Traffic over a whole run, for -S, summed over every board used */
+struct run_stats {
+	struct eeprom_stats		dev;
+	unsigned long			transactions;
+	struct eeprom_txn_stats		txn[eeprom_txn_kinds];
+	uint64_t			start_ns;
+};
+
+static const char *txn_names[eeprom_txn_kinds] = {
+	[eeprom_txn_read]	= "read",
+	[eeprom_txn_write]	= "write",
+	[eeprom_txn_poll]	= "poll",
+};
+
+static void gather_stats(struct run_stats *s, struct eeprom_dev *dev) {
+	int kind;
+
+	s->dev.reads += dev->stats.reads;
+	s->dev.writes += dev->stats.writes;
+	s->dev.bytes_read += dev->stats.bytes_read;
+	s->dev.bytes_written += dev->stats.bytes_written;
+	s->dev.xfer_ns += dev->stats.xfer_ns;
+	s->dev.waits += dev->stats.waits;
+	s->dev.wait_ns += dev->stats.wait_ns;
+	s->transactions += dev->be->transactions;
+	for (kind = 0; kind < eeprom_txn_kinds; kind++)
+		eeprom_txn_add(&s->txn[kind], &dev->be->txn[kind]);
+}
+
+/* Upper bound of a histogram bucket, in us, or 0 for the last one */
+static unsigned long bucket_limit_us(int bucket) {
+	if (bucket == EEPROM_TXN_BUCKETS - 1)
+		return 0;
+	return 1UL << bucket;
+}
+
+static void print_stats_text(const struct run_stats *s, uint64_t elapsed) {
+	static const char hashes[] = "########################################";
+	int kind, i;
+
+	fprintf(stderr, "Run took %.1f ms: %.1f ms in transfers, %.1f ms "
+			"waiting on %lu write cycles, %lu transactions\n",
+			elapsed / 1e6, s->dev.xfer_ns / 1e6,
+			s->dev.wait_ns / 1e6, s->dev.waits, s->transactions);
+
+	for (kind = 0; kind < eeprom_txn_kinds; kind++) {
+		const struct eeprom_txn_stats *txn = &s->txn[kind];
+		unsigned long most = 0;
+
+		if (!txn->count)
+			continue;
+
+		fprintf(stderr, "%s: %lu transactions, %lu errors, %lu "
+				"retries, %llu bytes, avg %.1f us, max %.1f "
+				"us\n", txn_names[kind], txn->count,
+				txn->errors, txn->retries,
+				(unsigned long long)txn->bytes,
+				txn->total_ns / 1e3 / txn->count,
+				txn->max_ns / 1e3);
+
+		for (i = 0; i < EEPROM_TXN_BUCKETS; i++)
+			if (txn->histogram[i] > most)
+				most = txn->histogram[i];
+
+		for (i = 0; i < EEPROM_TXN_BUCKETS; i++) {
+			unsigned long n = txn->histogram[i];
+			int bar = (n * (sizeof(hashes) - 1) + most - 1) / most;
+
+			if (!n)
+				continue;
+			if (bucket_limit_us(i))
+				fprintf(stderr, "    < %7lu us %8lu |%.*s\n",
+						bucket_limit_us(i), n, bar, hashes);
+			else
+				fprintf(stderr, "   >= %7lu us %8lu |%.*s\n",
+						bucket_limit_us(i - 1), n, bar, hashes);
+		}
+	}
+}
+
+static void print_stats_json(const struct run_stats *s, uint64_t elapsed) {
+	int kind, i;
+
+	fprintf(stderr, "{\"elapsed_us\": %llu, \"xfer_us\": %llu, "
+			"\"wait_us\": %llu, \"waits\": %lu, "
+			"\"transactions\": %lu",
+			(unsigned long long)elapsed / 1000,
+			(unsigned long long)s->dev.xfer_ns / 1000,
+			(unsigned long long)s->dev.wait_ns / 1000,
+			s->dev.waits, s->transactions);
+
+	for (kind = 0; kind < eeprom_txn_kinds; kind++) {
+		const struct eeprom_txn_stats *txn = &s->txn[kind];
+		const char *sep = "";
+
+		fprintf(stderr, ", \"%s\": {\"count\": %lu, \"errors\": %lu, "
+				"\"retries\": %lu, \"bytes\": %llu, "
+				"\"total_us\": %llu, \"max_us\": %llu, "
+				"\"histogram\": [",
+				txn_names[kind], txn->count, txn->errors,
+				txn->retries, (unsigned long long)txn->bytes,
+				(unsigned long long)txn->total_ns / 1000,
+				(unsigned long long)txn->max_ns / 1000);
+
+		/* Only buckets with something in; lt_us is null for the last */
+		for (i = 0; i < EEPROM_TXN_BUCKETS; i++) {
+			if (!txn->histogram[i])
+				continue;
+			if (bucket_limit_us(i))
+				fprintf(stderr, "%s{\"lt_us\": %lu, \"count\": "
+						"%lu}", sep, bucket_limit_us(i),
+						txn->histogram[i]);
+			else
+				fprintf(stderr, "%s{\"lt_us\": null, \"count\": "
+						"%lu}", sep, txn->histogram[i]);
+			sep = ", ";
+		}
+		fprintf(stderr, "]}");
+	}
+	fprintf(stderr, "}\n");
+}
+
+static void print_stats(const struct run_stats *s, const char *format) {
+	uint64_t elapsed = now_ns() - s->start_ns;
+
+	if (!strcmp(format, "json"))
+		print_stats_json(s, elapsed);
+	else
+		print_stats_text(s, elapsed);
+}
+
+/* One board being handled as part of a multi-target run */
+struct target {
+	char			*path;
+	int			addr;
+
+	struct eeprom_dev	*dev;
+	enum eeprom_origin	origin;
+	int			ret;
+	uint64_t		elapsed_ns;
+
+	/* Why the board failed, if it did */
+	struct eeprom_error	error;
+
+	/* True once a batch serial and MAC have been handed out */
+	int			assigned;
+
+	/* Why the board's result couldn't be logged, if it couldn't */
+	struct eeprom_error	log_error;
+};
+
+struct target_run {
+	struct target			*targets;
+	const struct eeprom_update	*update;
+	struct eeprom_batch		*batch;
+	int				writing;
+	int				ack_poll_ms;
+	int				verify;
+	int				retries;
+	int				retry_max_ms;
+};
+
+/* Worker for eeprom_pool_run(): read, and maybe update, one board */
+static void run_target(void *arg, int job) {
+	struct target_run *run = arg;
+	struct target *t = &run->targets[job];
+	uint64_t start = now_ns();
+
+	t->ret = 1;
+	t->dev = eeprom_open(t->path, t->addr, &t->error);
+	if (!t->dev)
+		goto log;
+
+	t->dev->ack_poll_ms = run->ack_poll_ms;
+	t->dev->verify = run->verify;
+	t->dev->be->retries = run->retries;
+	t->dev->be->retry_max_ms = run->retry_max_ms;
+
+	if (!run->writing) {
+		t->ret = eeprom_read(t->dev);
+		goto out;
+	}
+
+	if (eeprom_prepare(t->dev, &t->origin))
+		goto out;
+
+	/* Only boards that answered get a serial and MAC from the batch */
+	if (run->batch && run->batch->have_template)
+		memcpy(&t->dev->data, &run->batch->template,
+			sizeof(t->dev->data));
+	eeprom_apply_update(t->dev, run->update);
+	if (run->batch) {
+		if (eeprom_batch_assign(run->batch, job, t->dev, t->path,
+					t->addr, &t->error))
+			goto log;
+		t->assigned = 1;
+	}
+
+	t->ret = eeprom_write(t->dev);
+
+out:
+	if (t->ret)
+		t->error = t->dev->error;
+log:
+	/* As each board finishes, so a crash loses no earlier results */
+	if (run->batch)
+		eeprom_batch_log(run->batch, t->path, t->addr, t->dev,
+				 t->assigned, t->ret ? "failed" : "ok",
+				 &t->log_error);
+	t->elapsed_ns = now_ns() - start;
+}
+
+struct erase_progress {
+	uint64_t			start;
+};
+
+static void print_erase_progress(void *arg, uint32_t done, uint32_t total) {
+	struct erase_progress *p = arg;
+	uint64_t elapsed = now_ns() - p->start;
+
+	fprintf(stderr, "\rErased %u/%u bytes (%.1f KiB/s)", done, total,
+			elapsed ? done / 1024.0 / (elapsed / 1e9) : 0.0);
+}
+
+/*
+ * Work out what -x names (offset,length, "oops" or "all") and erase
+ * it, reporting progress as it goes.
+ */
+static int erase(struct eeprom_dev *dev, const char *range, int writing) {
+	struct novena_eeprom_data_v2 *v2 = &dev->data.v2;
+	struct erase_progress progress;
+	uint32_t offset = 0, count = 0;
+	uint64_t elapsed;
+	char *end;
+	int ret;
+
+	if (!writing) {
+		printf("Not erasing, as -w was not specified\n");
+		return 1;
+	}
+
+	if (!strcmp(range, "oops")) {
+		if (eeprom_read(dev))
+			return 1;
+		if (memcmp(v2->signature, NOVENA_SIGNATURE,
+				sizeof(v2->signature))
+		 || v2->version < 2
+		 || !(v2->features & feature_eepromoops)
+		 || !v2->eepromoops_length) {
+			fprintf(stderr, "No eepromoops area on the EEPROM\n");
+			return 1;
+		}
+		offset = v2->eepromoops_offset;
+		count = v2->eepromoops_length;
+	}
+	else if (strcmp(range, "all")) {
+		offset = strtoul(range, &end, 0);
+		if (*end != ',' || end[1] == '\0')
+			goto bad_range;
+		count = strtoul(end + 1, &end, 0);
+		if (*end || !count)
+			goto bad_range;
+	}
+
+	progress.start = now_ns();
+	ret = eeprom_erase(dev, offset, count, print_erase_progress,
+			   &progress);
+	elapsed = now_ns() - progress.start;
+	fprintf(stderr, "\n");
+	if (ret)
+		return ret;
+
+	printf("Erased: %d pages written, %d already blank, %.1f ms\n",
+		dev->pages_written, dev->pages_skipped, elapsed / 1e6);
+	return 0;
+
+bad_range:
+	fprintf(stderr, "Erase range must be offset,length, \"oops\" or "
+			"\"all\", not \"%s\"\n", range);
+	return 1;
+}
+
+static const char *origin_name(enum eeprom_origin origin) {
+	switch (origin) {
+	case eeprom_origin_v1:
+		return ", upgraded from v1";
+	case eeprom_origin_v2:
+		return ", upgraded from v2";
+	case eeprom_origin_corrupt:
+		return ", bad header CRC, defaults set";
+	case eeprom_origin_blank:
+		return ", blank, defaults set";
+	case eeprom_origin_unknown:
+		return ", unknown version, defaults set";
+	default:
+		return "";
+	}
+}
+
+/*
+ * Drive every target concurrently and report on each one.  Total time
+ * is set by the slowest board rather than the sum of all of them.
+ */
+static int run_targets(struct target *targets, int ntargets, int nworkers,
+		       const struct eeprom_update *update,
+		       struct eeprom_batch *batch, int writing,
+		       int ack_poll_ms, int verify, int retries,
+		       int retry_max_ms, struct run_stats *stats) {
+	struct target_run run;
+	uint64_t start = now_ns();
+	int failed = 0;
+	int i;
+
+	run.targets = targets;
+	run.update = update;
+	run.batch = batch;
+	run.writing = writing;
+	run.ack_poll_ms = ack_poll_ms;
+	run.verify = verify;
+	run.retries = retries;
+	run.retry_max_ms = retry_max_ms;
+
+	i = eeprom_pool_run(nworkers ? nworkers : ntargets, ntargets,
+			    run_target, &run);
+	if (i) {
+		fprintf(stderr, "Unable to start worker threads: %s\n",
+				strerror(i));
+		return 1;
+	}
+
+	for (i = 0; i < ntargets; i++) {
+		struct target *t = &targets[i];
+
+		printf("%s@0x%02x: ", t->path, t->addr);
+		if (t->assigned)
+			printf("serial %u, MAC %02x:%02x:%02x:%02x:%02x:%02x, ",
+				t->dev->data.v2.serial,
+				t->dev->data.v2.mac[0], t->dev->data.v2.mac[1],
+				t->dev->data.v2.mac[2], t->dev->data.v2.mac[3],
+				t->dev->data.v2.mac[4], t->dev->data.v2.mac[5]);
+		if (t->ret) {
+			printf("FAILED: %s (%.1f ms)\n",
+				t->error.code ? t->error.message
+					      : "unknown error",
+				t->elapsed_ns / 1000000.0);
+			failed++;
+		}
+		else if (writing)
+			printf("updated%s, %d pages written, %d unchanged "
+				"pages skipped (%.1f ms)\n",
+				origin_name(t->origin),
+				t->dev->pages_written, t->dev->pages_skipped,
+				t->elapsed_ns / 1000000.0);
+		else {
+			printf("read (%.1f ms)\n", t->elapsed_ns / 1000000.0);
+			print_eeprom_data(t->dev);
+		}
+		if (t->log_error.code)
+			fprintf(stderr, "%s\n", t->log_error.message);
+		if (stats && t->dev)
+			gather_stats(stats, t->dev);
+		eeprom_close(&t->dev);
+	}
+
+	printf("%d of %d targets succeeded in %.1f ms\n",
+		ntargets - failed, ntargets, (now_ns() - start) / 1000000.0);
+	return failed != 0;
+}
+
 int main(int argc, char **argv) {
 	struct eeprom_dev *dev;
 	int ch;
 	int writing = 0;
 	char *tmp;
-
-	struct novena_eeprom_data_v2 newrom;
+	char *dump_file = NULL;
+	char *restore_file = NULL;
+	char *export_file = NULL;
+	char *import_file = NULL;
+	char *device = I2C_BUS;
+	int device_named = 0;
+	int device_addr = EEPROM_ADDRESS;
+	int ack_poll_ms = 0;
+	int verify = 0;
+	int retries = RETRY_DEFAULT_COUNT;
+	int retry_max_ms = RETRY_DEFAULT_MAX_MS;
+	struct target *targets = NULL;
+	int ntargets = 0;
+	int nworkers = 0;
+	uint16_t features;
+	struct eeprom_error err;
+	char *manifest = NULL;
+	char *cache_dir = NULL;
+	uint32_t get_fields = 0;
+	char **records = NULL;
+	int nrecords = 0;
+	char *oops_cursor = NULL;
+	char **oops_files = NULL;
+	int noops_files = 0;
+	char *erase_range = NULL;
+	char *stats_format = NULL;
+	char *probe_scratch = NULL;
+	int scanning = 0;
+	struct run_stats stats;
+	int ret = 0;
+
+	struct eeprom_update update;
+	struct novena_eeprom_data_v2 *newrom = &update.data;
 
 	int newdata = 0;
-	int update_mac = 0;
-	int update_features = 0;
-	int update_serial = 0;
-	int update_oops_start = 0;
-	int update_oops_length = 0;
-	int update_page_size = 0;
-	int update_total_size = 0;
-	int update_lvds1 = 0;
-	int update_lvds2 = 0;
-	int update_hdmi = 0;
-
-	dev = eeprom_open(I2C_BUS, EEPROM_ADDRESS);
-	if (!dev)
-		return 1;
 
-	while ((ch = getopt(argc, argv, "hm:s:f:wo:p:l:1:2:d:e:i:")) != -1) {
+	memset(&update, 0, sizeof(update));
+	memset(&stats, 0, sizeof(stats));
+	stats.start_ns = now_ns();
+
+	while ((ch = getopt(argc, argv, "hm:s:f:wo:p:l:1:2:d:e:i:a:VE:I:D:T:j:B:C:g:t:O:A:x:S:R:P:F")) != -1) {
 		switch(ch) {
 
 		/* MAC address */
 		case 'm':
-			if (parse_mac(optarg, newrom.mac))
-				return 1;
-			update_mac = 1;
+			if (eeprom_parse_mac(optarg, newrom->mac, &err))
+				goto parse_err;
+			update.fields |= update_mac;
 			break;
 
 		/* Serial number */
 		case 's':
-			newrom.serial = strtoul(optarg, NULL, 0);
-			update_serial = 1;
+			newrom->serial = strtoul(optarg, NULL, 0);
+			update.fields |= update_serial;
 			break;
 
 		/* Featuresset */
 		case 'f':
-			newrom.features = parse_features(optarg);
-			if (newrom.features == -1)
-				return 1;
-			update_features = 1;
+			if (eeprom_parse_features(optarg, &features, &err))
+				goto parse_err;
+			newrom->features = features;
+			update.fields |= update_features;
 			break;
 
 		case 'o':
-			newrom.eepromoops_offset = strtoul(optarg, &tmp, 0);
-			update_oops_start = 1;
+			newrom->eepromoops_offset = strtoul(optarg, &tmp, 0);
+			update.fields |= update_oops_start;
 			if (tmp && *tmp) {
-				newrom.eepromoops_length = strtoul(tmp + 1,
-								    NULL, 0);
-				update_oops_length = 1;
+				newrom->eepromoops_length = strtoul(tmp + 1,
+								     NULL, 0);
+				update.fields |= update_oops_length;
 			}
 			break;
 
 		case 'p':
-			newrom.page_size = strtoul(optarg, NULL, 0);
-			update_page_size = 1;
+			newrom->page_size = strtoul(optarg, NULL, 0);
+			update.fields |= update_page_size;
 			break;
 
 		case 'l':
-			newrom.eeprom_size = strtoul(optarg, NULL, 0);
-			update_total_size = 1;
+			newrom->eeprom_size = strtoul(optarg, NULL, 0);
+			update.fields |= update_total_size;
 			break;
 
 		case '1':
-			if (parse_modesetting(&newrom.lvds1, optarg))
-				return 1;
-			update_lvds1 = 1;
+			if (eeprom_parse_modesetting(&newrom->lvds1, optarg,
+						     &err))
+				goto parse_err;
+			update.fields |= update_lvds1;
 			break;
 
 		case '2':
-			if (parse_modesetting(&newrom.lvds2, optarg))
-				return 1;
-			update_lvds2 = 1;
+			if (eeprom_parse_modesetting(&newrom->lvds2, optarg,
+						     &err))
+				goto parse_err;
+			update.fields |= update_lvds2;
 			break;
 
 		case 'd':
-			if (parse_modesetting(&newrom.hdmi, optarg))
-				return 1;
-			update_hdmi = 1;
+			if (eeprom_parse_modesetting(&newrom->hdmi, optarg,
+						     &err))
+				goto parse_err;
+			update.fields |= update_hdmi;
 			break;
 
 		case 'e':
-			return eeprom_export(dev, optarg);
+			export_file = optarg;
+			break;
 
 		case 'i':
-			if (eeprom_import(dev, optarg))
+			import_file = optarg;
+			break;
+
+		case 'E':
+			dump_file = optarg;
+			break;
+
+		case 'I':
+			restore_file = optarg;
+			break;
+
+		/* Poll for write completion rather than sleeping */
+		case 'a':
+			ack_poll_ms = strtoul(optarg, NULL, 0);
+			if (!ack_poll_ms)
+				ack_poll_ms = ACK_POLL_TIMEOUT_MS;
+			break;
+
+		/* Check every page that gets written by reading it back */
+		case 'V':
+			verify = 1;
+			break;
+
+		/* Retries of transient bus errors, and the longest backoff */
+		case 'R':
+			retries = strtoul(optarg, &tmp, 0);
+			if (*tmp == ',')
+				retry_max_ms = strtoul(tmp + 1, NULL, 0);
+			break;
+
+		/* Device to talk to, rather than the default I2C bus */
+		case 'D':
+			if (parse_target(optarg, &device_addr))
+				return 1;
+			device = optarg;
+			device_named = 1;
+			break;
+
+		/* Record to get, or set if a value is given */
+		case 't':
+			records = realloc(records,
+					  (nrecords + 1) * sizeof(*records));
+			if (!records) {
+				perror("Unable to alloc data");
+				return 1;
+			}
+			records[nrecords++] = optarg;
+			break;
+
+		/* Print new oops records, keeping our place in this file */
+		case 'O':
+			oops_cursor = optarg;
+			break;
+
+		/* File to append to the eepromoops area as a record */
+		case 'A':
+			oops_files = realloc(oops_files, (noops_files + 1)
+						* sizeof(*oops_files));
+			if (!oops_files) {
+				perror("Unable to alloc data");
+				return 1;
+			}
+			oops_files[noops_files++] = optarg;
+			break;
+
+		/* Range to erase: offset,length, "oops" or "all" */
+		case 'x':
+			erase_range = optarg;
+			break;
+
+		/* Look for chips on every bus */
+		case 'F':
+			scanning = 1;
+			break;
+
+		/* Work out the real geometry, using this scratch block */
+		case 'P':
+			probe_scratch = optarg;
+			break;
+
+		/* Report bus statistics at the end, as text or json */
+		case 'S':
+			if (strcmp(optarg, "text") && strcmp(optarg, "json")) {
+				fprintf(stderr, "Statistics format must be "
+						"\"text\" or \"json\"\n");
+				return 1;
+			}
+			stats_format = optarg;
+			break;
+
+		/* Add a board to drive concurrently with the others */
+		case 'T':
+			targets = realloc(targets,
+					  (ntargets + 1) * sizeof(*targets));
+			if (!targets) {
+				perror("Unable to alloc data");
+				return 1;
+			}
+			memset(&targets[ntargets], 0, sizeof(*targets));
+			targets[ntargets].addr = EEPROM_ADDRESS;
+			if (parse_target(optarg, &targets[ntargets].addr))
 				return 1;
-			newdata = 1;
+			targets[ntargets].path = optarg;
+			ntargets++;
+			break;
+
+		/* Number of boards to work on at once */
+		case 'j':
+			nworkers = strtoul(optarg, NULL, 0);
+			break;
+
+		/* Print just these fields, reading only what's needed */
+		case 'g':
+			if (parse_fields(optarg, &get_fields))
+				return 1;
+			break;
+
+		/* Keep a copy of the image on disk between runs */
+		case 'C':
+			cache_dir = optarg;
+			break;
+
+		/* Provision boards as described by a manifest */
+		case 'B':
+			manifest = optarg;
 			break;
 
 		/* Write data */
@@ -665,10 +1320,182 @@ int main(int argc, char **argv) {
 	argc -= optind;
 	argv += optind;
 
-	if (update_mac || update_serial || update_features ||
-		update_oops_start || update_oops_length ||
-		update_page_size || update_total_size ||
-		update_lvds1 || update_lvds2 || update_hdmi)
+	if (scanning)
+		return scan(device_named ? device : NULL);
+
+	if (ntargets || manifest) {
+		struct eeprom_batch batch;
+		int i;
+
+		if (export_file || import_file || dump_file || restore_file) {
+			fprintf(stderr, "-e, -i, -E and -I work on a single "
+					"device, and can't be used with -T "
+					"or -B\n");
+			return 1;
+		}
+
+		if (!manifest) {
+			ret = run_targets(targets, ntargets, nworkers,
+					  &update, NULL, writing, ack_poll_ms,
+					  verify, retries, retry_max_ms,
+					  stats_format ? &stats : NULL);
+			if (stats_format)
+				print_stats(&stats, stats_format);
+			return ret;
+		}
+
+		if (!writing) {
+			printf("Not provisioning, as -w was not specified\n");
+			return 1;
+		}
+
+		if (eeprom_batch_load(&batch, manifest, &err)) {
+			fprintf(stderr, "%s\n", err.message);
+			return 1;
+		}
+
+		/* Explicit rows say which device each board is on */
+		if (batch.nrows) {
+			if (ntargets) {
+				fprintf(stderr, "Manifest rows already list "
+						"devices, so -T can't be "
+						"used\n");
+				eeprom_batch_free(&batch);
+				return 1;
+			}
+			targets = calloc(batch.nrows, sizeof(*targets));
+			if (!targets) {
+				perror("Unable to alloc data");
+				eeprom_batch_free(&batch);
+				return 1;
+			}
+			for (i = 0; i < batch.nrows; i++) {
+				targets[i].path = batch.rows[i].device;
+				targets[i].addr = EEPROM_ADDRESS;
+				if (parse_target(targets[i].path,
+						 &targets[i].addr)) {
+					eeprom_batch_free(&batch);
+					return 1;
+				}
+			}
+			ntargets = batch.nrows;
+		}
+		else if (!ntargets) {
+			targets = calloc(1, sizeof(*targets));
+			if (!targets) {
+				perror("Unable to alloc data");
+				eeprom_batch_free(&batch);
+				return 1;
+			}
+			targets[0].path = device;
+			targets[0].addr = device_addr;
+			ntargets = 1;
+		}
+
+		ret = run_targets(targets, ntargets, nworkers, &update,
+				  &batch, writing, ack_poll_ms, verify,
+				  retries, retry_max_ms,
+				  stats_format ? &stats : NULL);
+		eeprom_batch_free(&batch);
+		free(targets);
+		if (stats_format)
+			print_stats(&stats, stats_format);
+		return ret;
+	}
+
+	dev = eeprom_open(device, device_addr, &err);
+	if (!dev) {
+		fprintf(stderr, "%s\n", err.message);
+		return 1;
+	}
+
+	dev->ack_poll_ms = ack_poll_ms;
+	dev->verify = verify;
+	dev->be->retries = retries;
+	dev->be->retry_max_ms = retry_max_ms;
+
+	if (cache_dir && eeprom_cache_enable(dev, cache_dir)) {
+		ret = 1;
+		goto out;
+	}
+
+	if (get_fields) {
+		ret = print_fields(dev, get_fields);
+		goto out;
+	}
+
+	if (records) {
+		ret = run_records(dev, records, nrecords, writing);
+		goto out;
+	}
+
+	if (oops_cursor) {
+		ret = read_oops(dev, oops_cursor);
+		goto out;
+	}
+
+	if (erase_range) {
+		ret = erase(dev, erase_range, writing);
+		goto out;
+	}
+
+	if (probe_scratch) {
+		ret = probe_geometry(dev, strtoul(probe_scratch, NULL, 0),
+				     writing);
+		goto out;
+	}
+
+	if (oops_files) {
+		ret = append_oops(dev, oops_files, noops_files, writing);
+		goto out;
+	}
+
+	if (export_file) {
+		ret = eeprom_export(dev, export_file);
+		goto out;
+	}
+
+	if (import_file) {
+		if (eeprom_import(dev, import_file)) {
+			ret = 1;
+			goto out;
+		}
+		newdata = 1;
+	}
+
+	/* Whole-chip operations, using -l and -p as geometry overrides */
+	if (dump_file) {
+		ret = eeprom_dump(dev, dump_file,
+				  (update.fields & update_total_size)
+					? newrom->eeprom_size : 0);
+		goto out;
+	}
+
+	if (restore_file) {
+		if (!writing) {
+			printf("Not restoring %s, as -w was not specified\n",
+				restore_file);
+			ret = 1;
+			goto out;
+		}
+		if (eeprom_restore(dev, restore_file,
+				   (update.fields & update_total_size)
+					? newrom->eeprom_size : 0,
+				   (update.fields & update_page_size)
+					? newrom->page_size : 0)) {
+			print_error(dev);
+			printf("EEPROM restore failed\n");
+			ret = 1;
+			goto out;
+		}
+		printf("Restored EEPROM (%d pages written, %d unchanged pages "
+			"skipped).  New values:\n",
+			dev->pages_written, dev->pages_skipped);
+		print_eeprom_data(dev);
+		goto out;
+	}
+
+	if (update.fields)
 		newdata = 1;
 
 	if (argc)
@@ -680,70 +1507,42 @@ int main(int argc, char **argv) {
 		print_eeprom_data(dev);
 	}
 	else {
-		int ret;
-		ret = eeprom_read(dev);
+		enum eeprom_origin origin;
+
+		ret = eeprom_prepare(dev, &origin);
 		if (ret)
-			return 1;
-		if (dev->data.v1.version == 1) {
-			printf("Updating v1 EEPROM to v2...\n");
-			eeprom_upgrade_v1_to_v2(dev);
-		}
-		else if (dev->data.v1.version == 2) {
-			/* Ignore v2 */;
-		}
-		else {
-			if (memcmp(dev->data.v2.signature, NOVENA_SIGNATURE,
-					sizeof(dev->data.v2.signature)))
-				printf("Blank EEPROM found, "
-					"setting defaults...\n");
-			else
-				fprintf(stderr,
-					"Unrecognized EEPROM version found "
-					"(v%d), overwriting with v2\n",
-					dev->data.v1.version);
-			eeprom_get_defaults(dev);
-		}
+			goto out;
 
-		if (update_mac)
-			memcpy(&dev->data.v2.mac, newrom.mac, sizeof(newrom.mac));
-		if (update_serial)
-			dev->data.v2.serial = newrom.serial;
-		if (update_features)
-			dev->data.v2.features = newrom.features;
-		if (update_oops_start)
-			dev->data.v2.eepromoops_offset = newrom.eepromoops_offset;
-		if (update_oops_length)
-			dev->data.v2.eepromoops_length = newrom.eepromoops_length;
-		if (update_page_size)
-			dev->data.v2.page_size = newrom.page_size;
-		if (update_total_size)
-			dev->data.v2.eeprom_size = newrom.eeprom_size;
-		if (update_lvds1)
-			memcpy(&dev->data.v2.lvds1, &newrom.lvds1,
-				sizeof(dev->data.v2.lvds1));
-		if (update_lvds2)
-			memcpy(&dev->data.v2.lvds2, &newrom.lvds2,
-				sizeof(dev->data.v2.lvds2));
-		if (update_hdmi)
-			memcpy(&dev->data.v2.hdmi, &newrom.hdmi,
-				sizeof(dev->data.v2.hdmi));
-		memcpy(&dev->data.v2.signature,
-				NOVENA_SIGNATURE,
-				sizeof(dev->data.v2.signature));
-
-		dev->data.v2.version = 2;
+		print_origin(dev, origin);
+		eeprom_apply_update(dev, &update);
 
 		ret = eeprom_write(dev);
 		if (ret) {
+			print_error(dev);
 			printf("EEPROM write failed\n");
-			return 1;
+			goto out;
 		}
 
-		printf("Updated EEPROM.  New values:\n");
+		printf("Updated EEPROM (%d pages written, %d unchanged pages "
+			"skipped).  New values:\n",
+			dev->pages_written, dev->pages_skipped);
 		print_eeprom_data(dev);
 	}
 
+out:
+	if (ret)
+		print_error(dev);
+	if (stats_format) {
+		gather_stats(&stats, dev);
+		print_stats(&stats, stats_format);
+	}
 	eeprom_close(&dev);
+	free(records);
+	free(oops_files);
 
-	return 0;
+	return ret;
+
+parse_err:
+	fprintf(stderr, "%s\n", err.message);
+	return 1;
 }
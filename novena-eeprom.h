@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#pragma GCC visibility push(default)
+
 #define NOVENA_SIGNATURE "Novena"
 
 /* Bitmask polarities used as flag */
@@ -40,50 +42,14 @@ struct modesetting {
 	uint32_t	flags;		/* enum modesetting_flags mask */
 } __attribute__((__packed__));
 
-#ifndef __cplusplus	/* C++ doesn't support named assignment */
 struct available_modesetting_flags {
 	uint32_t	flags;
-	char		*name;
-	char		*descr;
-} available_modesetting_flags[] = {
-	{
-		.name	= "channel_present",
-		.flags	= channel_present,
-		.descr	= "This channel is present",
-	},
-	{
-		.name	= "dual_channel",
-		.flags	= dual_channel,
-		.descr	= "Channel is dual-lane",
-	},
-	{
-		.name	= "vsync_polarity",
-		.flags	= vsync_polarity,
-		.descr	= "VSync polarity is positive",
-	},
-	{
-		.name	= "hsync_polarity",
-		.flags	= hsync_polarity,
-		.descr	= "HSync polarity is positive",
-	},
-	{
-		.name	= "mapping_jeida",
-		.flags	= mapping_jeida,
-		.descr	= "Use JEIDA (as opposed to PSWG) mapping",
-	},
-	{
-		.name	= "data_width_8bit",
-		.flags	= data_width_8bit,
-		.descr	= "Use 8-bit (as opposed to 6 [LVDS] or 10 [HDMI] bit)",
-	},
-	{
-		.name	= "ignore_settings",
-		.flags	= ignore_settings,
-		.descr	= "Ignore settings and attempt to auto-detect",
-	},
-	{} /* Sentinal */
+	const char	*name;
+	const char	*descr;
 };
-#endif /* ! __cplusplus */
+
+/* Sentinel-terminated list of known flags, defined in eeprom-parse.c */
+extern const struct available_modesetting_flags eeprom_modesetting_flags[];
 
 enum feature_flags {
 	feature_es8328 		= 0x0001,
@@ -99,70 +65,14 @@ enum feature_flags {
 	feature_lidbootblock	= 0x0400,
 };
 
-#ifndef __cplusplus	/* C++ doesn't support named assignment */
 struct feature {
 	uint32_t	flags;
-	char		*name;
-	char		*descr;
-} features[] = {
-	{
-		.name	= "es8328",
-		.flags	= feature_es8328,
-		.descr	= "ES8328 audio codec",
-	},
-	{
-		.name	= "senoko",
-		.flags	= feature_senoko,
-		.descr	= "Senoko battery board",
-	},
-	{
-		.name	= "edp",
-		.flags	= feature_retina,
-		.descr	= "eDP bridge chip",
-	},
-	{
-		.name	= "pixelqi",
-		.flags	= feature_pixelqi,
-		.descr	= "PixelQi LVDS display (deprecated)",
-	},
-	{
-		.name	= "pcie",
-		.flags	= feature_pcie,
-		.descr	= "PCI Express support",
-	},
-	{
-		.name	= "gbit",
-		.flags	= feature_gbit,
-		.descr	= "Gigabit Ethernet",
-	},
-	{
-		.name	= "hdmi",
-		.flags	= feature_hdmi,
-		.descr	= "HDMI Output (deprecated)",
-	},
-	{
-		.name	= "eepromoops",
-		.flags	= feature_eepromoops,
-		.descr	= "EEPROM Oops storage",
-	},
-	{
-		.name	= "sataroot",
-		.flags	= feature_rootsrc_sata,
-		.descr	= "Root device is SATA",
-	},
-	{
-		.name	= "heirloom",
-		.flags	= feature_heirloom,
-		.descr	= "Laptop is an Heirloom model",
-	},
-	{
-		.name	= "lidbootblock",
-		.flags	= feature_lidbootblock,
-		.descr	= "Prevent booting when lid is shut",
-	},
-	{} /* Sentinal */
+	const char	*name;
+	const char	*descr;
 };
-#endif /* ! __cplusplus */
+
+/* Sentinel-terminated list of known features, defined in eeprom-parse.c */
+extern const struct feature eeprom_features[];
 
 /*
  * For structure documentation, see:
@@ -175,7 +85,7 @@ struct novena_eeprom_data_v1 {
 	uint32_t	serial;		/* 32-bit serial number */
 	uint8_t		mac[6];		/* Gigabit MAC address */
 
-	/* Features present, from struct feature features[] below */
+	/* Features present, from eeprom_features[] above */
 	uint16_t	features;	/* Native byte order */
 } __attribute__((__packed__));
 
@@ -187,7 +97,7 @@ struct novena_eeprom_data_v2 {
 	uint32_t	serial;		/* 32-bit serial number */
 	uint8_t		mac[6];		/* Gigabit MAC address */
 
-	/* Features present, from struct feature features[] below */
+	/* Features present, from eeprom_features[] above */
 	uint16_t	features;	/* Native byte order */
 
 	/* Describes default resolutions of various output devices */
@@ -203,4 +113,130 @@ struct novena_eeprom_data_v2 {
 	uint32_t	eepromoops_length;
 } __attribute__((__packed__));
 
+/*
+ * V3 is v2 with a sequence number, a length and a checksum appended, so
+ * that boot code can reject a corrupt header before acting on any of
+ * it.  header_crc is the standard CRC32 (as returned by zlib's
+ * crc32(0, ...)) of the first header_length - 4 bytes.  It is always the
+ * last four bytes of the header, so later versions can grow the header
+ * without moving it.
+ *
+ * A v3 header lives in one of two slots, at offset 0 and at
+ * NOVENA_SLOT_B_OFFSET.  Each write goes to the slot not in use, with
+ * the sequence number one higher, so a write cut short by a power loss
+ * always leaves the other slot intact.  Readers use the valid slot with
+ * the newer sequence number.  Whenever a write lands in slot B, slot A
+ * is written again straight afterwards, so once a write completes slot
+ * A holds the newest header and code that only knows v2 (U-Boot, the
+ * kernel) can keep reading offset 0.  Only a write cut short between the
+ * two leaves slot B the newer; novena_eeprom_pick_slot() copes with that.
+ */
+#define NOVENA_SLOT_B_OFFSET	0x80
+
+struct novena_eeprom_data_v3 {
+	uint8_t		signature[6];	/* 'Novena' */
+	uint8_t		version;	/* 3 */
+	uint8_t		page_size;	/* Size of EEPROM read/write page */
+	uint32_t	serial;		/* 32-bit serial number */
+	uint8_t		mac[6];		/* Gigabit MAC address */
+
+	/* Features present, from eeprom_features[] above */
+	uint16_t	features;	/* Native byte order */
+
+	/* Describes default resolutions of various output devices */
+	struct modesetting	lvds1;	/* LVDS channel 1 settings */
+	struct modesetting	lvds2;	/* LVDS channel 2 settings */
+	struct modesetting	hdmi;	/* HDMI settings */
+
+	/* An indicator of how large this particular EEPROM is */
+	uint32_t	eeprom_size;
+
+	/* If eepromoops is present, describes eepromoops storage */
+	uint32_t	eepromoops_offset;
+	uint32_t	eepromoops_length;
+
+	/* Bumped on every write, to tell the newer slot apart */
+	uint32_t	sequence;
+
+	/* Bytes in the header, including header_crc */
+	uint32_t	header_length;
+	uint32_t	header_crc;	/* Covers everything before it */
+} __attribute__((__packed__));
+
+/*
+ * Board properties that don't warrant a header field live in a record
+ * area after the header.  A fixed-size index at a fixed offset lists
+ * every record, so a reader can find one by reading the index and then
+ * the record itself, without scanning the chip.  Each record is a
+ * struct novena_tlv_record, then the key, then the value.  The area
+ * ends before the eepromoops area, if there is one.
+ */
+#define NOVENA_TLV_MAGIC	"NVTL"
+#define NOVENA_TLV_INDEX_OFFSET	0x100
+#define NOVENA_TLV_MAX_RECORDS	32
+
+struct novena_tlv_entry {
+	uint32_t	key_crc;	/* crc32() of the key */
+	uint16_t	offset;		/* Of the record, from the start of the chip */
+	uint16_t	length;		/* Of the record, including its header */
+	uint32_t	crc;		/* crc32() of the whole record */
+} __attribute__((__packed__));
+
+struct novena_tlv_index {
+	uint8_t		magic[4];	/* 'NVTL' */
+	uint16_t	count;		/* Entries in use */
+	uint16_t	area_end;	/* First byte past the last record */
+	struct novena_tlv_entry	entries[NOVENA_TLV_MAX_RECORDS];
+	uint32_t	crc;		/* Covers everything before it */
+} __attribute__((__packed__));
+
+#define NOVENA_TLV_RECORDS_OFFSET \
+	(NOVENA_TLV_INDEX_OFFSET + sizeof(struct novena_tlv_index))
+
+struct novena_tlv_record {
+	uint8_t		key_length;
+	uint8_t		reserved;
+	uint16_t	value_length;
+} __attribute__((__packed__));
+
+/*
+ * The eepromoops area, described by eepromoops_offset and _length, is a
+ * ring of crash log records.  Records are written one after another,
+ * each starting on a NOVENA_OOPS_ALIGN boundary, and go back to the
+ * start of the area when the next one won't fit before the end.
+ * Sequence numbers go up by one per record.  crc covers the header up
+ * to crc, then the payload as stored.
+ */
+#define NOVENA_OOPS_MAGIC	0x53504f4f	/* 'OOPS' */
+#define NOVENA_OOPS_ALIGN	4
+
+struct novena_oops_record {
+	uint32_t	magic;		/* NOVENA_OOPS_MAGIC */
+	uint32_t	sequence;
+	uint32_t	timestamp;	/* Seconds since the epoch, or 0 */
+	uint16_t	length;		/* Bytes of payload after the header */
+	uint16_t	flags;
+	uint32_t	crc;
+} __attribute__((__packed__));
+
+enum oops_flags {
+	/* Payload is an LZ4 block; length is its compressed size */
+	oops_lz4	= 0x0001,
+};
+
+/*
+ * Reference reader for v3 and later headers, for boot code to copy.
+ * Returns 0 if the len bytes at data hold a header whose CRC matches.
+ */
+int novena_eeprom_check(const void *data, uint32_t len);
+
+/*
+ * Given the len bytes read from each of the two slots, return the slot
+ * (0 or 1) to use, or -1 if neither holds a valid v3 header.
+ */
+int novena_eeprom_pick_slot(const void *slot_a, const void *slot_b,
+			    uint32_t len);
+
+#pragma GCC visibility pop
+
 #endif /* __NOVENA_EEPROM_H__ */